@@ -0,0 +1,306 @@
+/*
+** Micro-benchmark for the string escaping behind the CLI's json, csv,
+** quote/insert and tcl output modes (sqlite3/shell.c).
+**
+** It first times shellScanEscape(), which finds the next byte that needs
+** escaping, with the portable loop and with each SIMD version this CPU
+** can run.  Every version is checked against the portable one first.
+** Then it times output_json_string(), output_csv(),
+** output_quoted_escaped_string() and sout_c_string() on fields of a few
+** typical shapes, which use whatever shellScanEscape() picks at runtime.
+** Throughput is in input bytes per second.
+**
+** shell.c is included so that its static functions can be called.
+**
+** build: gcc -O2 -I../sqlite3 -o escape_bench escape_bench.c ../sqlite3/sqlite3.c -lpthread -ldl -lm
+**
+** usage: escape_bench [MEGABYTES]
+*/
+
+#define main escape_bench_shell_main
+#include "shell.c"
+#undef main
+
+#include <time.h>
+
+#define N_FIELD 4096
+
+static double seconds(void)
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/* A set of N_FIELD NUL-terminated fields of one shape */
+typedef struct Corpus Corpus;
+struct Corpus
+{
+    const char* name;
+    char* az[N_FIELD];
+    i64 an[N_FIELD];
+    i64 nByte;
+};
+
+static unsigned int rand_state = 1;
+static unsigned int next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/*
+** Fill a corpus with fields of nMin to nMax bytes.  About one byte in
+** nSpecial is a quote, backslash, newline or control character.  If
+** bUtf8 is true about a quarter of the letters are two-byte characters.
+*/
+static void make_corpus(Corpus* p, const char* name, int nMin, int nMax, int nSpecial, int bUtf8)
+{
+    static const char azSpecial[] = "\"'\\\n\r\t\001";
+    int i, j;
+
+    p->name = name;
+    p->nByte = 0;
+    for (i = 0; i < N_FIELD; i++)
+    {
+        int n = nMin + (int)(next_rand() % (unsigned)(nMax - nMin + 1));
+        char* z = malloc(n + 2);
+        if (z == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (j = 0; j < n; j++)
+        {
+            unsigned int r = next_rand();
+            if (nSpecial > 0 && r % (unsigned)nSpecial == 0)
+            {
+                z[j] = azSpecial[(r >> 12) % (sizeof(azSpecial) - 1)];
+            }
+            else if (bUtf8 && (r >> 4) % 4 == 0 && j + 1 < n)
+            {
+                z[j++] = (char)0xc3;
+                z[j] = (char)(0xa0 + (r >> 12) % 16);
+            }
+            else if ((r >> 4) % 6 == 0)
+            {
+                z[j] = ' ';
+            }
+            else
+            {
+                z[j] = 'a' + (r >> 12) % 26;
+            }
+        }
+        z[n] = 0;
+        p->az[i] = z;
+        p->an[i] = n;
+        p->nByte += n;
+    }
+}
+
+static void free_corpus(Corpus* p)
+{
+    int i;
+    for (i = 0; i < N_FIELD; i++)
+    {
+        free(p->az[i]);
+    }
+}
+
+static const char* class_name(int eClass)
+{
+    switch (eClass)
+    {
+    case SHELL_ESC_JSON:
+        return "json";
+    case SHELL_ESC_CSV:
+        return "csv";
+    default:
+        return "c";
+    }
+}
+
+static double base_rate;
+
+/* report a rate, relative to the first one since base_rate was cleared */
+static void report(const char* name, double bytes, double t)
+{
+    double rate = bytes / t;
+    if (base_rate == 0)
+    {
+        base_rate = rate;
+    }
+    printf("%-28s %9.1f MB/s  %5.2fx\n", name, rate / 1e6, rate / base_rate);
+}
+
+static void report_rate(const char* name, double bytes, double t)
+{
+    printf("%-28s %9.1f MB/s\n", name, bytes / t / 1e6);
+}
+
+/* check xScan against the portable scanner at the first 64 offsets of every field */
+static void check_scan(const char* name, i64 (*xScan)(const char*, i64, int), int nMinLen, int eClass, Corpus* p)
+{
+    int i;
+    i64 j;
+    for (i = 0; i < N_FIELD; i++)
+    {
+        for (j = 0; j < 64 && p->an[i] - j >= nMinLen; j++)
+        {
+            i64 want = shellScanEscapeScalar(p->az[i] + j, p->an[i] - j, eClass);
+            if (xScan(p->az[i] + j, p->an[i] - j, eClass) != want)
+            {
+                fprintf(stderr, "%s: wrong answer for %s at offset %d of field %d\n", name, class_name(eClass),
+                        (int)j, i);
+                exit(1);
+            }
+        }
+    }
+}
+
+/* time xScan walking over every field, one escape at a time */
+static void bench_scan(const char* name, i64 (*xScan)(const char*, i64, int), int nMinLen, int eClass,
+                       Corpus* p, int nRep)
+{
+    double t;
+    i64 nSum = 0;
+    int r, i;
+
+    check_scan(name, xScan, nMinLen, eClass, p);
+    t = seconds();
+    for (r = 0; r < nRep; r++)
+    {
+        for (i = 0; i < N_FIELD; i++)
+        {
+            const char* z = p->az[i];
+            i64 n = p->an[i];
+            while (n > 0)
+            {
+                /* the SIMD versions leave short strings to the portable one */
+                i64 k = n >= nMinLen ? xScan(z, n, eClass) : shellScanEscapeScalar(z, n, eClass);
+                nSum += k;
+                if (k >= n)
+                {
+                    break;
+                }
+                z += k + 1;
+                n -= k + 1;
+            }
+        }
+    }
+    report(name, (double)p->nByte * nRep, seconds() - t);
+    if (nSum < 0)
+    {
+        printf("%lld\n", (long long)nSum);
+    }
+}
+
+static ShellState state;
+
+static void escape_one(int eMode, ShellOut* pOut, const char* z, i64 n)
+{
+    switch (eMode)
+    {
+    case 0:
+        output_json_string(pOut, z, n);
+        break;
+    case 1:
+        output_csv(&state, z, 1);
+        break;
+    case 2:
+        output_quoted_escaped_string(pOut, z);
+        break;
+    default:
+        sout_c_string(pOut, z);
+        break;
+    }
+}
+
+static void bench_escape(const char* name, int eMode, Corpus* p, int nRep)
+{
+    ShellOut* pOut = &state.outBuf;
+    double t;
+    int r, i;
+
+    t = seconds();
+    for (r = 0; r < nRep; r++)
+    {
+        for (i = 0; i < N_FIELD; i++)
+        {
+            escape_one(eMode, pOut, p->az[i], p->an[i]);
+            if (pOut->n > 65536)
+            {
+                pOut->n = 0;
+            }
+        }
+    }
+    report_rate(name, (double)p->nByte * nRep, seconds() - t);
+}
+
+/* number of passes over a corpus that add up to about mb megabytes */
+static int n_rep(Corpus* p, int mb)
+{
+    int n = (int)((double)mb * 1e6 / (double)p->nByte);
+    return n > 0 ? n : 1;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* azMode[] = {"output_json_string", "output_csv", "output_quoted_escaped", "sout_c_string"};
+    int mb = argc > 1 ? atoi(argv[1]) : 256;
+    Corpus aCorpus[4];
+    int i, eClass, eMode;
+
+    if (mb <= 0)
+    {
+        fprintf(stderr, "usage: %s [MEGABYTES]\n", argv[0]);
+        return 1;
+    }
+    make_corpus(&aCorpus[0], "short ascii (4-24 bytes)", 4, 24, 0, 0);
+    make_corpus(&aCorpus[1], "long ascii (200-2000 bytes)", 200, 2000, 0, 0);
+    make_corpus(&aCorpus[2], "text, 1 escape in 64", 20, 400, 64, 0);
+    make_corpus(&aCorpus[3], "utf-8 text (100-600 bytes)", 100, 600, 0, 1);
+    sqlite3_snprintf(sizeof(state.colSeparator), state.colSeparator, ",");
+    state.outBuf.out = stdout;
+
+    for (i = 0; i < 4; i++)
+    {
+        Corpus* p = &aCorpus[i];
+        int nRep = n_rep(p, mb);
+        for (eClass = SHELL_ESC_JSON; eClass <= SHELL_ESC_C; eClass++)
+        {
+            printf("\nshellScanEscape(%s), %s, %d MB\n", class_name(eClass), p->name, mb);
+            base_rate = 0;
+            bench_scan("portable", shellScanEscapeScalar, 0, eClass, p, nRep);
+#ifdef SHELL_SIMD_SSE2
+            bench_scan("sse2", shellScanEscapeSse2, 16, eClass, p, nRep);
+#endif
+#ifdef SHELL_SIMD_NEON
+            bench_scan("neon", shellScanEscapeNeon, 16, eClass, p, nRep);
+#endif
+#ifdef SHA3_X86_SIMD
+            if (sha3CpuFeatures() & SHA3_CPU_AVX2)
+            {
+                bench_scan("avx2", shellScanEscapeAvx2, 32, eClass, p, nRep);
+            }
+#endif
+            bench_scan("dispatched", shellScanEscape, 0, eClass, p, nRep);
+        }
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        Corpus* p = &aCorpus[i];
+        int nRep = n_rep(p, mb);
+        printf("\nescapers, %s, %d MB\n", p->name, mb);
+        for (eMode = 0; eMode < 4; eMode++)
+        {
+            bench_escape(azMode[eMode], eMode, p, nRep);
+        }
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        free_corpus(&aCorpus[i]);
+    }
+    sout_free(&state.outBuf);
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+** Micro-benchmark for the Keccak-f[1600] code behind the CLI's sha3(),
+** sha3_query() and .sha3sum (sqlite3/shell.c).
+**
+** It times KeccakF1600Step(), the portable implementation, and each of
+** the faster ones this CPU can run, and reports their throughput as
+** SHA3-256 input bytes per second.  The multi-lane ones permute several
+** independent states at once and are credited with the input of all of
+** them.  Every implementation is checked against the portable one first.
+** Finally it times SHA3Update() on aligned and unaligned buffers, which
+** uses whatever KeccakF1600() picks at runtime.
+**
+** shell.c is included so that its static functions can be called.
+**
+** build: gcc -O2 -I../sqlite3 -o sha3_bench sha3_bench.c ../sqlite3/sqlite3.c -lpthread -ldl -lm
+**
+** usage: sha3_bench [MEGABYTES]
+*/
+
+#define main sha3_bench_shell_main
+#include "shell.c"
+#undef main
+
+#include <time.h>
+
+#define SHA3_256_RATE 136
+
+static double seconds(void)
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void init_states(SHA3Context* a, int n)
+{
+    int i, j;
+    for (i = 0; i < n; i++)
+    {
+        SHA3Init(&a[i], 256);
+        for (j = 0; j < 25; j++)
+        {
+            a[i].u.s[j] = (u64)(i + 1) * 0x9e3779b97f4a7c15ULL * (u64)(j + 1);
+        }
+    }
+}
+
+static void check_states(const char* name, SHA3Context* a, SHA3Context* ref, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        if (memcmp(a[i].u.s, ref[i].u.s, sizeof(a[i].u.s)) != 0)
+        {
+            fprintf(stderr, "%s: lane %d differs from KeccakF1600Step()\n", name, i);
+            exit(1);
+        }
+    }
+}
+
+static double base_rate;
+
+static void report(const char* name, double bytes, double t)
+{
+    double rate = bytes / t;
+    if (base_rate == 0)
+    {
+        base_rate = rate;
+    }
+    printf("%-28s %9.1f MB/s  %5.2fx\n", name, rate / 1e6, rate / base_rate);
+}
+
+/* time nPerm calls of a single-state permutation */
+static void bench_single(const char* name, void (*xStep)(SHA3Context*), int nPerm)
+{
+    SHA3Context a[1], ref[1];
+    double t;
+    int i;
+
+    init_states(a, 1);
+    init_states(ref, 1);
+    for (i = 0; i < 3; i++)
+    {
+        xStep(a);
+        KeccakF1600Step(ref);
+    }
+    check_states(name, a, ref, 1);
+
+    t = seconds();
+    for (i = 0; i < nPerm; i++)
+    {
+        xStep(a);
+    }
+    report(name, (double)nPerm * SHA3_256_RATE, seconds() - t);
+}
+
+/* time nPerm/nLane calls of a permutation over nLane states */
+static void bench_lanes(const char* name, void (*xLanes)(SHA3Context**, int), int nLane, int nPerm)
+{
+    SHA3Context a[SHA3_MAX_LANES], ref[SHA3_MAX_LANES];
+    SHA3Context* ap[SHA3_MAX_LANES];
+    double t;
+    int i;
+
+    init_states(a, nLane);
+    init_states(ref, nLane);
+    for (i = 0; i < nLane; i++)
+    {
+        ap[i] = &a[i];
+    }
+    for (i = 0; i < 3; i++)
+    {
+        int j;
+        xLanes(ap, nLane);
+        for (j = 0; j < nLane; j++)
+        {
+            KeccakF1600Step(&ref[j]);
+        }
+    }
+    check_states(name, a, ref, nLane);
+
+    t = seconds();
+    for (i = 0; i < nPerm / nLane; i++)
+    {
+        xLanes(ap, nLane);
+    }
+    report(name, (double)(nPerm / nLane) * nLane * SHA3_256_RATE, seconds() - t);
+}
+
+static void bench_update(const char* name, const unsigned char* buf, unsigned int n, int nRep)
+{
+    SHA3Context cx;
+    double t;
+    int i;
+
+    t = seconds();
+    for (i = 0; i < nRep; i++)
+    {
+        SHA3Init(&cx, 256);
+        SHA3Update(&cx, buf, n);
+        SHA3Final(&cx);
+    }
+    report(name, (double)n * nRep, seconds() - t);
+}
+
+int main(int argc, char** argv)
+{
+    int mb = argc > 1 ? atoi(argv[1]) : 256;
+    int nPerm;
+    unsigned char* buf;
+    unsigned int n = 1 << 20;
+
+    if (mb <= 0)
+    {
+        fprintf(stderr, "usage: %s [MEGABYTES]\n", argv[0]);
+        return 1;
+    }
+    nPerm = (int)(((double)mb * 1e6) / SHA3_256_RATE);
+
+    printf("Keccak-f[1600], %d MB of SHA3-256 input per implementation\n", mb);
+    bench_single("portable", KeccakF1600Step, nPerm);
+#ifdef SHA3_X86_SIMD
+    if (sha3CpuFeatures() & SHA3_CPU_BMI)
+    {
+        bench_single("bmi", KeccakF1600StepBmi, nPerm);
+    }
+    if (sha3CpuFeatures() & SHA3_CPU_AVX2)
+    {
+        bench_lanes("avx2, 4 lanes", KeccakF1600x4, 4, nPerm);
+    }
+    if (sha3CpuFeatures() & SHA3_CPU_AVX512)
+    {
+        bench_lanes("avx-512, 8 lanes", KeccakF1600x8, 8, nPerm);
+    }
+#endif
+#ifdef SHELL_SIMD_NEON
+    bench_lanes("neon, 2 lanes", KeccakF1600x2, 2, nPerm);
+#endif
+
+    buf = malloc(n + 1);
+    if (buf == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(buf, 0x5a, n + 1);
+    printf("\nSHA3Update(), %d MB in 1 MB buffers\n", mb);
+    base_rate = 0;
+    bench_update("aligned", buf, n, mb);
+    bench_update("unaligned", buf + 1, n, mb);
+    free(buf);
+    return 0;
+}
@@ -122,76 +122,88 @@ public static class cb
 // sudo apt-get install musl-dev musl-tools
 // sudo apt-get install gcc-aarch64-linux-gnu
 
-    static void write_linux(
-        string libname,
-		linux_target t,
-        IList<string> cfiles,
-        Dictionary<string,string> defines,
-        IList<string> includes,
-        IList<string> libs
+    // Writes the target specific flags and returns the compiler to use.
+    static string write_linux_target_flags(
+        linux_target t,
+        TextWriter tw
         )
 	{
-        var subdir = t.subdir(libname);
-        var dest_sh = t.sh(libname);
-        var dest_gccargs = t.gccargs(libname);
-		string compiler;
-		using (TextWriter tw = new StreamWriter(dest_gccargs))
+		switch (t.target)
 		{
-			switch (t.target)
-			{
-				case "x64":
-					compiler = "gcc";
-					tw.Write(" -m64\n");
-					break;
+			case "x64":
+				tw.Write(" -m64\n");
+				return "gcc";
+
+			case "x64-v2":
+			case "x64-v3":
+				tw.Write(" -m64\n");
+				foreach (var f in get_x64_level_flags(t.target.Substring(4)))
+				{
+					tw.Write(" {0}\n", f);
+				}
+				return "gcc";
 
-				case "x86":
-					compiler = "gcc";
-					tw.Write(" -m32\n");
-					break;
+			case "x86":
+				tw.Write(" -m32\n");
+				return "gcc";
 
-				case "arm64":
-					compiler = "aarch64-linux-gnu-gcc";
-					break;
+			case "arm64":
+				return "aarch64-linux-gnu-gcc";
 
-				case "mips64":
-					compiler = "mips64el-linux-gnuabi64-gcc";
-					break;
+			case "mips64":
+				return "mips64el-linux-gnuabi64-gcc";
 
-				case "s390x":
-					compiler = "s390x-linux-gnu-gcc";
-					break;
+			case "s390x":
+				return "s390x-linux-gnu-gcc";
 
-				case "ppc64le":
-					compiler = "powerpc64le-linux-gnu-gcc";
-					break;
+			case "ppc64le":
+				return "powerpc64le-linux-gnu-gcc";
 
-				case "armhf":
-					compiler = "arm-linux-gnueabihf-gcc";
-					break;
+			case "armhf":
+				return "arm-linux-gnueabihf-gcc";
 
-				case "armsf":
-					compiler = "arm-linux-gnueabi-gcc";
-					break;
+			case "armsf":
+				return "arm-linux-gnueabi-gcc";
 
-				case "musl-x64":
-					compiler = "musl-gcc";
-					tw.Write(" -m64\n");
-					break;
+			case "musl-x64":
+				tw.Write(" -m64\n");
+				return "musl-gcc";
 
-				case "musl-armhf":
-					compiler = "arm-linux-musleabihf-cc";
-					break;
+			case "musl-armhf":
+				return "arm-linux-musleabihf-cc";
 
-				case "musl-arm64":
-					compiler = "aarch64-linux-musl-cc";
-					break;
+			case "musl-arm64":
+				return "aarch64-linux-musl-cc";
 
-				default:
-					throw new NotImplementedException();
-			}
+			default:
+				throw new NotImplementedException();
+		}
+	}
+
+    static void write_linux(
+        string libname,
+        build_profile profile,
+		linux_target t,
+        IList<string> cfiles,
+        Dictionary<string,string> defines,
+        IList<string> includes,
+        IList<string> libs
+        )
+	{
+        var subdir = profile.subdir(t.subdir(libname));
+        var dest_sh = t.sh(profile.tag(libname));
+        var dest_gccargs = t.gccargs(profile.tag(libname));
+		string compiler;
+		using (TextWriter tw = new StreamWriter(dest_gccargs))
+		{
+			compiler = write_linux_target_flags(t, tw);
 			tw.Write(" -shared\n");
 			tw.Write(" -fPIC\n");
-			tw.Write(" -O\n");
+			tw.Write(" {0}\n", profile.opt);
+			if (profile.lto)
+			{
+				tw.Write(" -flto\n");
+			}
 			foreach (var d in defines.Keys.OrderBy(q => q))
 			{
 				var v = defines[d];
@@ -228,8 +240,103 @@ public static class cb
         }
     }
 
+    // The training run executes target code, so cross targets go through
+    // qemu-user.  Either way PGO_RUNNER in the environment wins.
+    static string get_linux_pgo_runner(linux_target t)
+    {
+        switch (t.target)
+        {
+            case "x64":
+                return "";
+            case "arm64":
+                return "qemu-aarch64 -L /usr/aarch64-linux-gnu";
+            default:
+                throw new NotImplementedException();
+        }
+    }
+
+    // Three stage profile-guided build:  compile with instrumentation, run
+    // pgo/workload.c against the instrumented library, then compile again
+    // using the profile.  Objects are compiled one at a time with a fixed -o
+    // path, because gcc names the .gcda files after the object file and both
+    // stages have to agree on that name.
+    static void write_linux_pgo(
+        string libname,
+        build_profile profile,
+		linux_target t,
+        IList<string> cfiles,
+        Dictionary<string,string> defines,
+        IList<string> includes,
+        IList<string> libs
+        )
+	{
+        var subdir = profile.subdir(t.subdir(libname));
+        var dest_sh = t.sh(profile.tag(libname));
+        var dest_gccargs = t.gccargs(profile.tag(libname));
+		string compiler;
+		using (TextWriter tw = new StreamWriter(dest_gccargs))
+		{
+			compiler = write_linux_target_flags(t, tw);
+			tw.Write(" -fPIC\n");
+			tw.Write(" {0}\n", profile.opt);
+			if (profile.lto)
+			{
+				tw.Write(" -flto\n");
+			}
+			foreach (var d in defines.Keys.OrderBy(q => q))
+			{
+				var v = defines[d];
+				tw.Write(" -D{0}", d);
+				if (v != null)
+				{
+					tw.Write("={0}", v);
+				}
+				tw.Write("\n");
+			}
+			tw.Write(" -DNDEBUG\n");
+			foreach (var p in includes.Select(x => x.Replace("\\", "/")))
+			{
+				tw.Write(" -I{0}\n", p);
+			}
+		}
+		var objs = cfiles
+			.Select(x => string.Format("./obj/{0}/{1}.o", subdir, Path.GetFileNameWithoutExtension(x.Replace("\\", "/"))))
+			.ToArray();
+		var link_libs = string.Join("", libs.Select(x => " " + x.Replace("\\", "/")));
+		using (TextWriter tw = new StreamWriter(dest_sh))
+        {
+			tw.Write("#!/bin/sh\n");
+			tw.Write("set -e\n");
+			tw.Write("set -x\n");
+			tw.Write("PGO_RUNNER=\"${{PGO_RUNNER-{0}}}\"\n", get_linux_pgo_runner(t));
+            tw.Write("rm -rf \"./obj/{0}\"\n", subdir);
+            tw.Write("mkdir -p \"./obj/{0}\"\n", subdir);
+            tw.Write("mkdir -p \"./bin/{0}\"\n", subdir);
+
+			tw.Write("# stage 1: instrumented build\n");
+			for (int i = 0; i < cfiles.Count; i++)
+			{
+				tw.Write("{0} @{1} -fprofile-generate -c -o {2} {3}\n", compiler, dest_gccargs, objs[i], cfiles[i].Replace("\\", "/"));
+			}
+			tw.Write("{0} @{1} -shared -fprofile-generate -o \"./bin/{2}/lib{3}.so\" {4}{5}\n", compiler, dest_gccargs, subdir, libname, string.Join(" ", objs), link_libs);
+
+			tw.Write("# stage 2: training run\n");
+			tw.Write("{0} @{1} -I../sqlite3 -o ./obj/{2}/workload ../pgo/workload.c -L./bin/{2} -l{3} -lpthread -ldl -lm\n", compiler, dest_gccargs, subdir, libname);
+			tw.Write("LD_LIBRARY_PATH=./bin/{0} $PGO_RUNNER ./obj/{0}/workload ./obj/{0}/workload.db\n", subdir);
+
+			tw.Write("# stage 3: optimized build using the profile\n");
+			tw.Write("rm -f {0}\n", string.Join(" ", objs));
+			for (int i = 0; i < cfiles.Count; i++)
+			{
+				tw.Write("{0} @{1} -fprofile-use -fprofile-correction -Wno-missing-profile -c -o {2} {3}\n", compiler, dest_gccargs, objs[i], cfiles[i].Replace("\\", "/"));
+			}
+			tw.Write("{0} @{1} -shared -o \"./bin/{2}/lib{3}.so\" {4}{5}\n", compiler, dest_gccargs, subdir, libname, string.Join(" ", objs), link_libs);
+        }
+    }
+
     static void write_android_ndk_build(
         string libname,
+        build_profile profile,
         IList<android_target> targets,
         IList<string> cfiles,
         Dictionary<string,string> defines,
@@ -237,7 +344,7 @@ public static class cb
         IList<string> libs
         )
     {
-	var dest_dir = string.Format("android_{0}", libname);
+	var dest_dir = string.Format("android_{0}", profile.tag(libname));
 	Directory.CreateDirectory(dest_dir);
 	var dest_dir_jni = Path.Combine(dest_dir, "jni");
 	Directory.CreateDirectory(dest_dir_jni);
@@ -260,8 +367,13 @@ public static class cb
 		tw.Write("include $(CLEAR_VARS)\n");
 		tw.Write("LOCAL_MODULE := lib{0}\n", libname);
 		tw.Write("LOCAL_MODULE_FILENAME := lib{0}\n", libname);
-		tw.Write("LOCAL_CFLAGS := -O {0}\n", string.Join(" ", defs));
+		tw.Write("LOCAL_CFLAGS := {0} {1}\n", profile.opt, string.Join(" ", defs));
         tw.Write("LOCAL_LDLIBS := -llog\n");
+		if (profile.lto)
+		{
+			tw.Write("LOCAL_CFLAGS += -flto\n");
+			tw.Write("LOCAL_LDFLAGS := -flto\n");
+		}
 		if (includes.Count > 0)
 		{
 			tw.Write("LOCAL_C_INCLUDES := {0}\n", string.Join(" ", inc));
@@ -286,6 +398,7 @@ public static class cb
 
     static void write_android(
         string libname,
+        build_profile profile,
 		android_target t,
         IList<string> cfiles,
         Dictionary<string,string> defines,
@@ -293,9 +406,9 @@ public static class cb
         IList<string> libs
         )
 	{
-        var subdir = t.subdir(libname);
-        var dest_sh = t.sh(libname);
-        var dest_gccargs = t.gccargs(libname);
+        var subdir = profile.subdir(t.subdir(libname));
+        var dest_sh = t.sh(profile.tag(libname));
+        var dest_gccargs = t.gccargs(profile.tag(libname));
 		string compiler;
 		using (TextWriter tw = new StreamWriter(dest_gccargs))
 		{
@@ -331,7 +444,11 @@ public static class cb
 			}
 			tw.Write(" -shared\n");
 			tw.Write(" -fPIC\n");
-			tw.Write(" -O\n");
+			tw.Write(" {0}\n", profile.opt);
+			if (profile.lto)
+			{
+				tw.Write(" -flto\n");
+			}
 			foreach (var d in defines.Keys.OrderBy(q => q))
 			{
 				var v = defines[d];
@@ -370,15 +487,16 @@ public static class cb
 
     static void write_wasm(
         string libname,
+        build_profile profile,
         IList<string> cfiles,
         Dictionary<string, string> defines,
         IList<string> includes,
         IList<string> libs)
     {
-        var dest_filelist = string.Format("wasm_{0}.libtoolfiles", libname);
+        var dest_filelist = string.Format("wasm_{0}.libtoolfiles", profile.tag(libname));
         using (TextWriter tw = new StreamWriter(dest_filelist))
         {
-            var subdir = string.Format("{0}/wasm", libname);
+            var subdir = profile.subdir(string.Format("{0}/wasm", libname));
             foreach (var s in cfiles)
             {
                 var b = Path.GetFileNameWithoutExtension(s);
@@ -386,17 +504,17 @@ public static class cb
                 tw.Write("{0}\n", o);
             }
         }
-        using (TextWriter tw = new StreamWriter(string.Format("wasm_{0}.sh", libname)))
+        using (TextWriter tw = new StreamWriter(string.Format("wasm_{0}.sh", profile.tag(libname))))
         {
             tw.Write("#!/bin/sh\n");
             tw.Write("set -e\n");
             tw.Write("set -x\n");
-            var subdir = string.Format("{0}/wasm", libname);
+            var subdir = profile.subdir(string.Format("{0}/wasm", libname));
             tw.Write("mkdir -p \"./obj/{0}\"\n", subdir);
             foreach (var s in cfiles)
             {
                 tw.Write("emcc");
-                tw.Write(" -Oz");
+                tw.Write(" {0}", profile.opt_wasm);
                 foreach (var d in defines.Keys.OrderBy(q => q))
                 {
                     var v = defines[d];
@@ -416,19 +534,21 @@ public static class cb
                 tw.Write(" {0}\n", s);
             }
             tw.Write("mkdir -p \"./bin/{0}/$1\"\n", subdir);
-            tw.Write("emar rcs ./bin/{0}/$1/{1}.a @wasm_{1}.libtoolfiles\n", subdir, libname);
+            tw.Write("emar rcs ./bin/{0}/$1/{1}.a @{2}\n", subdir, libname, dest_filelist);
         }
     }
 
     static void write_maccatalyst_dynamic(
         string libname,
+        build_profile profile,
         IList<string> cfiles,
         Dictionary<string,string> defines,
         IList<string> includes,
         IList<string> libs
         )
 	{
-        var dest_sh = string.Format("maccatalyst_dynamic_{0}.sh", libname);
+        var dest_sh = string.Format("maccatalyst_dynamic_{0}.sh", profile.tag(libname));
+        var dir = profile.subdir(libname);
 		var arches = new string[] {
 			"x86_64",
 			"arm64"
@@ -441,12 +561,16 @@ public static class cb
 			tw.Write("set -x\n");
 			foreach (string arch in arches)
 			{
-				tw.Write("mkdir -p \"./bin/{0}/maccatalyst/{1}\"\n", libname, arch);
+				tw.Write("mkdir -p \"./bin/{0}/maccatalyst/{1}\"\n", dir, arch);
 				tw.Write("xcrun");
 				tw.Write(" --sdk macosx");
 				tw.Write(" clang");
 				tw.Write(" -dynamiclib");
-				tw.Write(" -O");
+				tw.Write(" {0}", profile.opt);
+				if (profile.lto)
+				{
+					tw.Write(" -flto");
+				}
                                 tw.Write(" -target x86_64-apple-ios-macabi");
 				tw.Write(" -arch {0}", arch);
 				foreach (var d in defines.Keys.OrderBy(q => q))
@@ -462,29 +586,31 @@ public static class cb
 				{
 					tw.Write(" -I{0}", p);
 				}
-				tw.Write(" -o ./bin/{0}/maccatalyst/{1}/lib{0}.dylib", libname, arch);
+				tw.Write(" -o ./bin/{0}/maccatalyst/{1}/lib{2}.dylib", dir, arch, libname);
 				foreach (var s in cfiles)
 				{
 					tw.Write(" {0}", s);
 				}
 				tw.Write(" -lc");
 				tw.Write(" \n");
-				archLibraries.AppendFormat("./bin/{0}/maccatalyst/{1}/lib{0}.dylib ", libname, arch);
+				archLibraries.AppendFormat("./bin/{0}/maccatalyst/{1}/lib{2}.dylib ", dir, arch, libname);
 			}
 			// Create a universal binary from each of the architectures
-			tw.Write("lipo {1} -create -output ./bin/{0}/maccatalyst/lib{0}.dylib\n", libname, archLibraries);
+			tw.Write("lipo {1} -create -output ./bin/{0}/maccatalyst/lib{2}.dylib\n", dir, archLibraries, libname);
 		}
 	}
 
     static void write_mac_dynamic(
         string libname,
+        build_profile profile,
         IList<string> cfiles,
         Dictionary<string,string> defines,
         IList<string> includes,
         IList<string> libs
         )
 	{
-        var dest_sh = string.Format("mac_dynamic_{0}.sh", libname);
+        var dest_sh = string.Format("mac_dynamic_{0}.sh", profile.tag(libname));
+        var dir = profile.subdir(libname);
 		var arches = new string[] {
 			"x86_64",
 			"arm64"
@@ -497,12 +623,16 @@ public static class cb
 			tw.Write("set -x\n");
 			foreach (string arch in arches)
 			{
-				tw.Write("mkdir -p \"./bin/{0}/mac/{1}\"\n", libname, arch);
+				tw.Write("mkdir -p \"./bin/{0}/mac/{1}\"\n", dir, arch);
 				tw.Write("xcrun");
 				tw.Write(" --sdk macosx");
 				tw.Write(" clang");
 				tw.Write(" -dynamiclib");
-				tw.Write(" -O");
+				tw.Write(" {0}", profile.opt);
+				if (profile.lto)
+				{
+					tw.Write(" -flto");
+				}
 				tw.Write(" -arch {0}", arch);
 				foreach (var d in defines.Keys.OrderBy(q => q))
 				{
@@ -517,29 +647,31 @@ public static class cb
 				{
 					tw.Write(" -I{0}", p);
 				}
-				tw.Write(" -o ./bin/{0}/mac/{1}/lib{0}.dylib", libname, arch);
+				tw.Write(" -o ./bin/{0}/mac/{1}/lib{2}.dylib", dir, arch, libname);
 				foreach (var s in cfiles)
 				{
 					tw.Write(" {0}", s);
 				}
 				tw.Write(" -lc");
 				tw.Write(" \n");
-				archLibraries.AppendFormat("./bin/{0}/mac/{1}/lib{0}.dylib ", libname, arch);
+				archLibraries.AppendFormat("./bin/{0}/mac/{1}/lib{2}.dylib ", dir, arch, libname);
 			}
 			// Create a universal binary from each of the architectures
-			tw.Write("lipo {1} -create -output ./bin/{0}/mac/lib{0}.dylib\n", libname, archLibraries);
+			tw.Write("lipo {1} -create -output ./bin/{0}/mac/lib{2}.dylib\n", dir, archLibraries, libname);
 		}
 	}
 
     static void write_mac_static(
         string libname,
+        build_profile profile,
         IList<string> cfiles,
         Dictionary<string,string> defines,
         IList<string> includes,
         IList<string> libs
         )
 	{
-        var dest_sh = string.Format("mac_static_{0}.sh", libname);
+        var dest_sh = string.Format("mac_static_{0}.sh", profile.tag(libname));
+        var dir = profile.subdir(libname);
 		var arches = new string[] {
 			"x86_64",
 			"arm64"
@@ -547,10 +679,10 @@ public static class cb
 		StringBuilder archLibraries = new StringBuilder();
 		foreach (var arch in arches)
 		{
-			var dest_filelist = string.Format("mac_{0}_{1}.libtoolfiles", libname, arch);
+			var dest_filelist = string.Format("mac_{0}_{1}.libtoolfiles", profile.tag(libname), arch);
 			using (TextWriter tw = new StreamWriter(dest_filelist))
 			{
-				var subdir = string.Format("{0}/mac/{1}", libname, arch);
+				var subdir = string.Format("{0}/mac/{1}", dir, arch);
 				foreach (var s in cfiles)
 				{
                 var b = Path.GetFileNameWithoutExtension(s);
@@ -566,14 +698,14 @@ public static class cb
 			tw.Write("set -x\n");
 			foreach (var arch in arches)
 			{
-				var subdir = string.Format("{0}/mac/{1}", libname, arch);
+				var subdir = string.Format("{0}/mac/{1}", dir, arch);
 				tw.Write("mkdir -p \"./obj/{0}\"\n", subdir);
 				    foreach (var s in cfiles)
 				{
 					tw.Write("xcrun");
 					tw.Write(" --sdk macosx");
 					tw.Write(" clang");
-					tw.Write(" -O");
+					tw.Write(" {0}", profile.opt);
 					tw.Write(" -arch {0}", arch);
 					foreach (var d in defines.Keys.OrderBy(q => q))
 					{
@@ -593,23 +725,25 @@ public static class cb
 					tw.Write(" -o ./obj/{0}/{1}.o", subdir, b);
 					tw.Write(" {0}\n", s);
 				}
-				tw.Write("libtool -static -o ./bin/{0}/mac/{1}/{0}.a -filelist mac_{0}_{1}.libtoolfiles\n", libname, arch);
-				archLibraries.AppendFormat("./bin/{0}/mac/{1}/{0}.a ", libname, arch);
+				tw.Write("libtool -static -o ./bin/{0}/mac/{1}/{2}.a -filelist mac_{3}_{1}.libtoolfiles\n", dir, arch, libname, profile.tag(libname));
+				archLibraries.AppendFormat("./bin/{0}/mac/{1}/{2}.a ", dir, arch, libname);
 			}
 			// Create a universal binary from each of the architectures
-			tw.Write("lipo {1} -create -output ./bin/{0}/mac/{0}.a\n", libname, archLibraries);
+			tw.Write("lipo {1} -create -output ./bin/{0}/mac/{2}.a\n", dir, archLibraries, libname);
 		}
 	}
 
     static void write_tvos(
         string libname,
+        build_profile profile,
         IList<string> cfiles,
         Dictionary<string,string> defines,
         IList<string> includes,
         IList<string> libs
         )
 	{
-        var dest_sh = string.Format("tvos_{0}.sh", libname);
+        var dest_sh = string.Format("tvos_{0}.sh", profile.tag(libname));
+        var dir = profile.subdir(libname);
 		var arches_simulator = new string[] {
 			//"i386",
 			"x86_64",
@@ -620,12 +754,12 @@ public static class cb
 			//"armv7s",
 		};
 		var arches = arches_simulator.Concat(arches_device).ToArray();
-		var dest_filelist = string.Format("tvos_{0}.libtoolfiles", libname);
+		var dest_filelist = string.Format("tvos_{0}.libtoolfiles", profile.tag(libname));
 		using (TextWriter tw = new StreamWriter(dest_filelist))
 		{
 			foreach (var arch in arches)
 			{
-				var subdir = string.Format("{0}/tvos/{1}", libname, arch);
+				var subdir = string.Format("{0}/tvos/{1}", dir, arch);
 				foreach (var s in cfiles)
 				{
                 var b = Path.GetFileNameWithoutExtension(s);
@@ -639,10 +773,10 @@ public static class cb
 			tw.Write("#!/bin/sh\n");
 			tw.Write("set -e\n");
 			tw.Write("set -x\n");
-		    tw.Write("mkdir -p \"./bin/{0}/tvos\"\n", libname);
+		    tw.Write("mkdir -p \"./bin/{0}/tvos\"\n", dir);
 			foreach (var arch in arches)
 			{
-				var subdir = string.Format("{0}/tvos/{1}", libname, arch);
+				var subdir = string.Format("{0}/tvos/{1}", dir, arch);
 				tw.Write("mkdir -p \"./obj/{0}\"\n", subdir);
 				    foreach (var s in cfiles)
 				{
@@ -662,7 +796,7 @@ public static class cb
 							throw new NotImplementedException();
 					}
 					tw.Write(" clang");
-					tw.Write(" -O");
+					tw.Write(" {0}", profile.opt);
 					tw.Write(" -arch {0}", arch);
 					tw.Write(" -fembed-bitcode");
 					foreach (var d in defines.Keys.OrderBy(q => q))
@@ -684,19 +818,20 @@ public static class cb
 					tw.Write(" {0}\n", s);
 				}
 			}
-			var path_static = $"./bin/{libname}/tvos/{libname}.a";
+			var path_static = $"./bin/{dir}/tvos/{libname}.a";
 			tw.Write($"libtool -static -o {path_static} -filelist {dest_filelist}\n");
 
-			tw.Write("mkdir -p \"./bin/{0}/tvos/device\"\n", libname);
-			tw.Write($"xcrun --sdk appletvos clang {string.Join(" ", arches_device.Select(s => $"-arch {s}"))} -shared -all_load -o ./bin/{libname}/tvos/device/lib{libname}.dylib {path_static}\n");
+			tw.Write("mkdir -p \"./bin/{0}/tvos/device\"\n", dir);
+			tw.Write($"xcrun --sdk appletvos clang {string.Join(" ", arches_device.Select(s => $"-arch {s}"))} -shared -all_load -o ./bin/{dir}/tvos/device/lib{libname}.dylib {path_static}\n");
 
-			tw.Write("mkdir -p \"./bin/{0}/tvos/simulator\"\n", libname);
-			tw.Write($"xcrun --sdk appletvsimulator clang {string.Join(" ", arches_simulator.Select(s => $"-arch {s}"))} -shared -all_load -o ./bin/{libname}/tvos/simulator/lib{libname}.dylib {path_static}\n");
+			tw.Write("mkdir -p \"./bin/{0}/tvos/simulator\"\n", dir);
+			tw.Write($"xcrun --sdk appletvsimulator clang {string.Join(" ", arches_simulator.Select(s => $"-arch {s}"))} -shared -all_load -o ./bin/{dir}/tvos/simulator/lib{libname}.dylib {path_static}\n");
 		}
 	}
 
 	static void write_ios_arches(
 		string libname,
+		build_profile profile,
 		IList<string> cfiles,
 		Dictionary<string,string> defines,
 		IList<string> includes,
@@ -707,12 +842,13 @@ public static class cb
 		)
 	{
 		var subfolder_name = simulator ? "simulator" : "device";
-		var dest_filelist = $"ios_{subfolder_name}_{libname}.libtoolfiles";
+		var dest_filelist = $"ios_{subfolder_name}_{profile.tag(libname)}.libtoolfiles";
+		var dir = profile.subdir(libname);
 		using (TextWriter tw_filelist = new StreamWriter(dest_filelist))
 		{
 			foreach (var arch in arches)
 			{
-				var subdir = $"{libname}/ios/{subfolder_name}/{arch}";
+				var subdir = $"{dir}/ios/{subfolder_name}/{arch}";
 				foreach (var s in cfiles)
 				{
 					var b = Path.GetFileNameWithoutExtension(s);
@@ -722,17 +858,17 @@ public static class cb
 			}
 		}
 
-		tw.Write($"mkdir -p \"./bin/{libname}/ios/{subfolder_name}\"\n");
+		tw.Write($"mkdir -p \"./bin/{dir}/ios/{subfolder_name}\"\n");
 		foreach (var arch in arches)
 		{
-			var subdir = $"{libname}/ios/{subfolder_name}/{arch}";
+			var subdir = $"{dir}/ios/{subfolder_name}/{arch}";
 			tw.Write("mkdir -p \"./obj/{0}\"\n", subdir);
 			foreach (var s in cfiles)
 			{
 				tw.Write("xcrun");
 				tw.Write(simulator ? " --sdk iphonesimulator" : " --sdk iphoneos");
 				tw.Write(" clang");
-				tw.Write(" -O");
+				tw.Write(" {0}", profile.opt);
 				if (simulator)
 					tw.Write(" -mios-simulator-version-min=6.0");
 				else
@@ -757,22 +893,23 @@ public static class cb
 				tw.Write(" {0}\n", s);
 			}
 		}
-		var path_static = $"./bin/{libname}/ios/{subfolder_name}/{libname}.a";
+		var path_static = $"./bin/{dir}/ios/{subfolder_name}/{libname}.a";
 
-		tw.Write($"mkdir -p \"./bin/{libname}/ios/{subfolder_name}\"\n");
+		tw.Write($"mkdir -p \"./bin/{dir}/ios/{subfolder_name}\"\n");
 		tw.Write($"libtool -static -o {path_static} -filelist {dest_filelist}\n");
-		tw.Write($"xcrun --sdk {(simulator ? "iphonesimulator" : "iphoneos")} clang {string.Join(" ", arches.Select(s => $"-arch {s}"))} -shared -all_load -o ./bin/{libname}/ios/{subfolder_name}/lib{libname}.dylib {path_static}\n");
+		tw.Write($"xcrun --sdk {(simulator ? "iphonesimulator" : "iphoneos")} clang {string.Join(" ", arches.Select(s => $"-arch {s}"))} -shared -all_load -o ./bin/{dir}/ios/{subfolder_name}/lib{libname}.dylib {path_static}\n");
 	}
 
 	static void write_ios(
 		string libname,
+		build_profile profile,
 		IList<string> cfiles,
 		Dictionary<string,string> defines,
 		IList<string> includes,
 		IList<string> libs
 		)
 	{
-		var dest_sh = string.Format("ios_{0}.sh", libname);
+		var dest_sh = string.Format("ios_{0}.sh", profile.tag(libname));
 		var arches_simulator = new string[] {
 			"i386",
 			"x86_64",
@@ -788,13 +925,14 @@ public static class cb
 			tw.Write("#!/bin/sh\n");
 			tw.Write("set -e\n");
 			tw.Write("set -x\n");
-			write_ios_arches(libname, cfiles, defines, includes, libs, tw, true, arches_simulator);
-			write_ios_arches(libname, cfiles, defines, includes, libs, tw, false, arches_device);
+			write_ios_arches(libname, profile, cfiles, defines, includes, libs, tw, true, arches_simulator);
+			write_ios_arches(libname, profile, cfiles, defines, includes, libs, tw, false, arches_device);
 		}
 	}
 
     static void write_win(
         string libname,
+        build_profile profile,
         win_target t,
         IList<string> cfiles,
         Dictionary<string,string> defines,
@@ -809,9 +947,9 @@ public static class cb
         var vcvarsbat = get_vcvarsbat(vcversion, flavor);
         var toolchain = get_toolchain(vcversion, machine);
         var crt_option = get_crt_option(vcversion, flavor);
-        var subdir = t.subdir(libname);
-        var dest_bat = t.bat(libname);
-        var dest_linkargs = t.linkargs(libname);
+        var subdir = profile.win_subdir(t.subdir(libname));
+        var dest_bat = t.bat(profile.tag(libname));
+        var dest_linkargs = t.linkargs(profile.tag(libname));
 		using (TextWriter tw = new StreamWriter(dest_linkargs))
 		{
             tw.Write(" /nologo");
@@ -842,6 +980,10 @@ public static class cb
             tw.Write(" /INCREMENTAL:NO");
             tw.Write(" /OPT:REF");
             tw.Write(" /OPT:ICF");
+            if (profile.lto)
+            {
+                tw.Write(" /LTCG");
+            }
             tw.Write(" /TLBID:1");
             tw.Write(" /guard:cf");
             tw.Write(" /WINMD:NO");
@@ -929,7 +1071,11 @@ public static class cb
                 tw.Write(" /W1");
                 tw.Write(" /WX-");
                 tw.Write(" /sdl-");
-                tw.Write(" /O2");
+                tw.Write(" {0}", profile.opt_msvc);
+                if (profile.lto)
+                {
+                    tw.Write(" /GL");
+                }
                 tw.Write(" /Oi");
                 tw.Write(" /Oy-");
                 foreach (var d in defines.Keys.OrderBy(q => q))
@@ -1091,8 +1237,114 @@ public static class cb
         }
     }
 
+    // A build profile picks the optimization settings for every platform.
+    // The default profile keeps the historical file names and bin/ layout,
+    // every other profile gets its own bin/<profile>/ subtree and its
+    // profile name in the generated script names.
+    class build_profile
+    {
+        public string name { get; private set; }
+        public bool is_default { get; private set; }
+        public string opt { get; private set; }
+        public string opt_wasm { get; private set; }
+        public string opt_msvc { get; private set; }
+        public bool lto { get; private set; }
+        public string[] x64_levels { get; private set; }
+
+        public build_profile(
+            string aname,
+            bool adefault,
+            string aopt,
+            string aopt_wasm,
+            string aopt_msvc,
+            bool alto,
+            string[] ax64_levels
+            )
+        {
+            name = aname;
+            is_default = adefault;
+            opt = aopt;
+            opt_wasm = aopt_wasm;
+            opt_msvc = aopt_msvc;
+            lto = alto;
+            x64_levels = ax64_levels;
+        }
+
+        public string tag(string libname)
+        {
+            if (is_default)
+            {
+                return libname;
+            }
+            var s = string.Format("{0}_{1}", libname, name);
+            return s;
+        }
+        public string subdir(string s)
+        {
+            if (is_default)
+            {
+                return s;
+            }
+            return string.Format("{0}/{1}", name, s);
+        }
+        public string win_subdir(string s)
+        {
+            if (is_default)
+            {
+                return s;
+            }
+            return string.Format("{0}\\{1}", name, s);
+        }
+    }
+
+    // Static libraries (wasm, ios, tvos, mac_static) never get -flto, since
+    // that would put compiler-specific bitcode into the .a files we ship.
+    static build_profile[] profiles = new build_profile[]
+    {
+        new build_profile("size", false, "-Os", "-Oz", "/O1", false, new string[] { }),
+        new build_profile("balanced", true, "-O2", "-Oz", "/O2", false, new string[] { }),
+        new build_profile("throughput", false, "-O3", "-O3", "/O2", true, new string[] { "v2", "v3" }),
+    };
+
+    // Throughput settings plus profile-guided optimization, see write_linux_pgo
+    static build_profile profile_pgo = new build_profile("pgo", false, "-O3", "-O3", "/O2", true, new string[] { });
+
+    // x86-64 psABI micro-architecture levels, spelled out as feature flags
+    // because the gcc on the Linux build agents predates -march=x86-64-v2.
+    static string[] get_x64_level_flags(string level)
+    {
+        switch (level)
+        {
+            case "v2":
+                return new string[] {
+                    "-mcx16",
+                    "-msahf",
+                    "-mpopcnt",
+                    "-msse3",
+                    "-mssse3",
+                    "-msse4.1",
+                    "-msse4.2",
+                };
+            case "v3":
+                return get_x64_level_flags("v2").Concat(new string[] {
+                    "-mavx",
+                    "-mavx2",
+                    "-mbmi",
+                    "-mbmi2",
+                    "-mf16c",
+                    "-mfma",
+                    "-mlzcnt",
+                    "-mmovbe",
+                    "-mxsave",
+                }).ToArray();
+            default:
+                throw new NotImplementedException();
+        }
+    }
+
     static void write_win_multi(
         string libname,
+        build_profile profile,
         IList<win_target> trios,
         IList<string> cfiles,
         Dictionary<string,string> defines,
@@ -1104,6 +1356,7 @@ public static class cb
         {
             write_win(
                 libname,
+                profile,
                 t,
                 cfiles,
                 defines,
@@ -1112,18 +1365,19 @@ public static class cb
                 );
         }
 
-		using (TextWriter tw = new StreamWriter(string.Format("win_{0}.bat", libname)))
+		using (TextWriter tw = new StreamWriter(string.Format("win_{0}.bat", profile.tag(libname))))
         {
             tw.WriteLine("@echo on");
             foreach (var t in trios)
             {
-                tw.WriteLine("cmd /c {0} > err_{1}.buildoutput.txt 2>&1", t.bat(libname), t.basename(libname));
+                tw.WriteLine("cmd /c {0} > err_{1}.buildoutput.txt 2>&1", t.bat(profile.tag(libname)), t.basename(profile.tag(libname)));
             }
         }
     }
 
     static void write_linux_multi(
         string libname,
+        build_profile profile,
         string grp,
         IList<linux_target> targets,
         IList<string> cfiles,
@@ -1136,6 +1390,7 @@ public static class cb
         {
             write_linux(
                 libname,
+                profile,
                 t,
                 cfiles,
                 defines,
@@ -1144,20 +1399,21 @@ public static class cb
                 );
         }
 
-		using (TextWriter tw = new StreamWriter(string.Format("linux_{0}_{1}.sh", libname, grp)))
+		using (TextWriter tw = new StreamWriter(string.Format("linux_{0}_{1}.sh", profile.tag(libname), grp)))
         {
 			tw.Write("#!/bin/sh\n");
 			tw.Write("set -e\n");
 			tw.Write("set -x\n");
             foreach (var t in targets)
             {
-                tw.Write("./{0} > err_{1}.buildoutput.txt 2>&1\n", t.sh(libname), t.basename(libname));
+                tw.Write("./{0} > err_{1}.buildoutput.txt 2>&1\n", t.sh(profile.tag(libname)), t.basename(profile.tag(libname)));
             }
         }
     }
 
     static void write_android_multi(
         string libname,
+        build_profile profile,
         IList<android_target> targets,
         IList<string> cfiles,
         Dictionary<string,string> defines,
@@ -1169,6 +1425,7 @@ public static class cb
         {
             write_android(
                 libname,
+                profile,
                 t,
                 cfiles,
                 defines,
@@ -1177,14 +1434,14 @@ public static class cb
                 );
         }
 
-		using (TextWriter tw = new StreamWriter(string.Format("android_{0}.sh", libname)))
+		using (TextWriter tw = new StreamWriter(string.Format("android_{0}.sh", profile.tag(libname))))
         {
 			tw.Write("#!/bin/sh\n");
 			tw.Write("set -e\n");
 			tw.Write("set -x\n");
             foreach (var t in targets)
             {
-                tw.Write("./{0} > err_{1}.buildoutput.txt 2>&1\n", t.sh(libname), t.basename(libname));
+                tw.Write("./{0} > err_{1}.buildoutput.txt 2>&1\n", t.sh(profile.tag(libname)), t.basename(profile.tag(libname)));
             }
         }
     }
@@ -1230,6 +1487,7 @@ public static class cb
     }
 
     static void write_e_sqlite3(
+        build_profile profile
         )
     {
         var cfiles = new string[]
@@ -1313,6 +1571,7 @@ public static class cb
 			};
 			write_win_multi(
 				"e_sqlite3",
+				profile,
 				trios,
 				cfiles,
 				defines,
@@ -1336,7 +1595,9 @@ public static class cb
 			{
 				new linux_target("x64"),
 				new linux_target("x86"),
-			};
+			}
+			.Concat(profile.x64_levels.Select(v => new linux_target("x64-" + v)))
+			.ToArray();
 
 			var targets_cross = new linux_target[]
 			{
@@ -1353,6 +1614,7 @@ public static class cb
 
 			write_linux_multi(
 				"e_sqlite3",
+				profile,
                 "regular",
 				targets_regular,
 				cfiles,
@@ -1363,6 +1625,7 @@ public static class cb
 
 			write_linux_multi(
 				"e_sqlite3",
+				profile,
                 "cross",
 				targets_cross,
 				cfiles,
@@ -1395,6 +1658,7 @@ public static class cb
 #if true
 			write_android_ndk_build(
 				"e_sqlite3",
+				profile,
 				targets,
 				cfiles,
 				defines,
@@ -1404,6 +1668,7 @@ public static class cb
 #else
 			write_android_multi(
 				"e_sqlite3",
+				profile,
 				targets,
 				cfiles,
 				defines,
@@ -1426,6 +1691,7 @@ public static class cb
 
             write_wasm(
                 "e_sqlite3",
+                profile,
                 cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
                 defines,
                 includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -1445,6 +1711,7 @@ public static class cb
 
 			write_ios(
 				"e_sqlite3",
+				profile,
 				cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 				defines,
 				includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -1453,6 +1720,7 @@ public static class cb
 
 			write_tvos(
 				"e_sqlite3",
+				profile,
 				cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 				defines,
 				includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -1461,6 +1729,7 @@ public static class cb
 
 			write_mac_dynamic(
 				"e_sqlite3",
+				profile,
 				cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 				defines,
 				includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -1469,6 +1738,7 @@ public static class cb
 
 			write_maccatalyst_dynamic(
 				"e_sqlite3",
+				profile,
 				cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 				defines,
 				includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -1477,6 +1747,7 @@ public static class cb
 
 			write_mac_static(
 				"e_sqlite3",
+				profile,
 				cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 				defines,
 				includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -1486,11 +1757,55 @@ public static class cb
 
     }
 
-    static void write_e_sqlcipher()
+    static void write_e_sqlite3_pgo(
+        build_profile profile
+        )
+    {
+        var cfiles = new string[]
+        {
+            "..\\sqlite3\\sqlite3.c",
+            "..\\stubs\\stubs.c",
+        };
+
+		var defines = new Dictionary<string,string>();
+		add_basic_sqlite3_defines(defines);
+		add_linux_sqlite3_defines(defines);
+		var includes = new string[]
+		{
+		};
+		var libs = new string[]
+		{
+		};
+
+		var targets = new linux_target[]
+		{
+			new linux_target("x64"),
+			new linux_target("arm64"),
+		};
+
+		foreach (var t in targets)
+		{
+			write_linux_pgo(
+				"e_sqlite3",
+				profile,
+				t,
+				cfiles,
+				defines,
+				includes,
+				libs
+				);
+		}
+    }
+
+    static void write_e_sqlcipher(build_profile profile)
     {
 		var tomcrypt_src_dir = "..\\..\\libtomcrypt\\src";
 		var tomcrypt_include_dir = "..\\..\\libtomcrypt\\src\\headers";
         var sqlcipher_dir = "..\\sqlcipher";
+        // aes_accel.c includes libtomcrypt's portable ciphers/aes/aes.c
+        // and replaces aes_desc with a hardware-dispatching version.
+        // kdf_cache.c likewise wraps misc/pkcs5/pkcs_5_2.c.
+        var tomcrypt_ext_dir = "..\\tomcrypt_ext";
         var tomcrypt_cfiles = new string[]
 		{
 "modes\\cbc\\cbc_decrypt.c",
@@ -1508,7 +1823,6 @@ public static class cb
 "mac\\hmac\\hmac_process.c",
 "hashes\\sha2\\sha256.c",
 "hashes\\sha2\\sha512.c",
-"ciphers\\aes\\aes.c",
 "misc\\crypt\\crypt_argchk.c",
 "misc\\crypt\\crypt_hash_is_valid.c",
 "misc\\zeromem.c",
@@ -1521,7 +1835,6 @@ public static class cb
 "misc\\crypt\\crypt_register_cipher.c",
 "misc\\crypt\\crypt_find_hash.c",
 "misc\\compare_testvector.c",
-"misc\\pkcs5\\pkcs_5_2.c",
 "misc\\crypt\\crypt_register_prng.c",
 "hashes\\sha1.c",
 "misc\\crypt\\crypt_prng_descriptor.c",
@@ -1932,10 +2245,13 @@ public static class cb
         {
             cfiles.Add(Path.Combine(tomcrypt_src_dir, s));
         }
+        cfiles.Add(Path.Combine(tomcrypt_ext_dir, "aes_accel.c"));
+        cfiles.Add(Path.Combine(tomcrypt_ext_dir, "kdf_cache.c"));
 
 	var includes = new List<string>();
 	includes.Add(sqlcipher_dir);
 	includes.Add(tomcrypt_include_dir);
+	includes.Add(tomcrypt_src_dir);
 
 		{
 			var defines = new Dictionary<string,string>
@@ -2023,6 +2339,7 @@ public static class cb
 
 			write_win_multi(
 				"e_sqlcipher",
+				profile,
 				trios,
 				cfiles,
 				defines,
@@ -2056,7 +2373,9 @@ public static class cb
 			{
 				new linux_target("x64"),
 				new linux_target("x86"),
-			};
+			}
+			.Concat(profile.x64_levels.Select(v => new linux_target("x64-" + v)))
+			.ToArray();
 
 			var targets_cross = new linux_target[]
 			{
@@ -2071,6 +2390,7 @@ public static class cb
 
 			write_linux_multi(
 				"e_sqlcipher",
+				profile,
                 "regular",
 				targets_regular,
 				cfiles,
@@ -2080,6 +2400,7 @@ public static class cb
 				);
 			write_linux_multi(
 				"e_sqlcipher",
+				profile,
                 "cross",
 				targets_cross,
 				cfiles,
@@ -2118,6 +2439,7 @@ public static class cb
 
 			write_linux_multi(
 				"e_sqlcipher",
+				profile,
 				"cross",
 				targets_cross,
 				cfiles,
@@ -2161,6 +2483,7 @@ public static class cb
 #if true
 			write_android_ndk_build(
 				"e_sqlcipher",
+				profile,
 				targets,
 				cfiles,
 				defines,
@@ -2170,6 +2493,7 @@ public static class cb
 #else
 			write_android_multi(
 				"e_sqlcipher",
+				profile,
 				targets,
 				cfiles,
 				defines,
@@ -2202,6 +2526,7 @@ public static class cb
 
             write_wasm(
                "e_sqlcipher",
+               profile,
                cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
                defines,
                includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -2231,6 +2556,7 @@ public static class cb
 
 			write_ios(
 				"e_sqlcipher",
+				profile,
 				cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 				defines,
 				includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -2239,6 +2565,7 @@ public static class cb
 
 			write_mac_dynamic(
 				"e_sqlcipher",
+				profile,
 				cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 				defines,
 				includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -2247,6 +2574,7 @@ public static class cb
 
 			write_maccatalyst_dynamic(
 				"e_sqlcipher",
+				profile,
 				cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 				defines,
 				includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -2255,6 +2583,7 @@ public static class cb
 
 			write_mac_static(
 				"e_sqlcipher",
+				profile,
 				cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 				defines,
 				includes.Select(x => x.Replace("\\", "/")).ToArray(),
@@ -2263,7 +2592,7 @@ public static class cb
 		}
     }
 
-	static void write_sqlcipher_apple_cc()
+	static void write_sqlcipher_apple_cc(build_profile profile)
 	{
 		var sqlcipher_dir = "..\\sqlcipher";
 
@@ -2288,6 +2617,7 @@ public static class cb
 
 		write_ios(
 			"e_sqlcipher",
+			profile,
 			cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 			defines,
 			includes,
@@ -2296,6 +2626,7 @@ public static class cb
 
 		write_mac_dynamic(
 			"e_sqlcipher",
+			profile,
 			cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 			defines,
 			includes,
@@ -2304,6 +2635,7 @@ public static class cb
 
 		write_mac_static(
 			"e_sqlcipher",
+			profile,
 			cfiles.Select(x => x.Replace("\\", "/")).ToArray(),
 			defines,
 			includes,
@@ -2313,9 +2645,13 @@ public static class cb
 
     public static void Main()
     {
-        write_e_sqlite3();
-        write_e_sqlcipher();
-        //write_sqlcipher_apple_cc();
+        foreach (var profile in profiles)
+        {
+            write_e_sqlite3(profile);
+            write_e_sqlcipher(profile);
+            //write_sqlcipher_apple_cc(profile);
+        }
+        write_e_sqlite3_pgo(profile_pgo);
     }
 }
 
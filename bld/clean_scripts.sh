@@ -13,6 +13,6 @@ rm ./mac_*.sh
 rm ./maccatalyst_*.sh
 #rm -rf ./obj
 #rm -rf ./bin
-rm -rf ./android_sqlcipher
-rm -rf ./android_e_sqlite3
+rm -rf ./android_e_sqlite3 ./android_e_sqlite3_*
+rm -rf ./android_e_sqlcipher ./android_e_sqlcipher_*
 
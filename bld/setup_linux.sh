@@ -12,6 +12,7 @@ sudo apt-get install gcc-aarch64-linux-gnu
 sudo apt-get install gcc-mips64el-linux-gnuabi64
 sudo apt-get install gcc-s390x-linux-gnu
 sudo apt-get install gcc-powerpc64le-linux-gnu
+sudo apt-get install qemu-user
 
 mkdir crosscompilers
 cd crosscompilers
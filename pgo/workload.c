@@ -0,0 +1,365 @@
+
+/*
+** Training workload for the profile-guided e_sqlite3 builds.
+**
+** The pgo build scripts generated by bld/cb.cs run this program against an
+** instrumented libe_sqlite3.so.  It should exercise the code paths our
+** users hit most: an OLTP style insert/select/update mix, FTS5 queries,
+** JSON1 functions and RTREE window lookups.
+**
+** usage: workload DBFILE [SCALE]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "sqlite3.h"
+
+static sqlite3* db;
+
+static unsigned int rng_state = 2463534242u;
+
+static unsigned int rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static const char* words[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf",
+    "hotel", "india", "juliet", "kilo", "lima", "mike", "november",
+    "oscar", "papa", "quebec", "romeo", "sierra", "tango", "uniform",
+    "victor", "whiskey", "xray", "yankee", "zulu", "database", "index",
+    "cursor", "btree", "page", "journal", "query", "vacuum", "schema",
+};
+#define NWORDS ((int)(sizeof(words) / sizeof(words[0])))
+
+static void check(int rc, const char* psz)
+{
+    if ((rc != SQLITE_OK) && (rc != SQLITE_ROW) && (rc != SQLITE_DONE))
+    {
+        fprintf(stderr, "%s: %d -- %s\n", psz, rc, sqlite3_errmsg(db));
+        exit(1);
+    }
+}
+
+static void exec(const char* sql)
+{
+    char* err = NULL;
+    int rc = sqlite3_exec(db, sql, NULL, NULL, &err);
+    if (rc != SQLITE_OK)
+    {
+        fprintf(stderr, "%s: %d -- %s\n", sql, rc, err ? err : "");
+        exit(1);
+    }
+}
+
+static sqlite3_stmt* prepare(const char* sql)
+{
+    sqlite3_stmt* stmt;
+    check(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL), sql);
+    return stmt;
+}
+
+/* step a statement to completion, then reset it for the next use */
+static void run(sqlite3_stmt* stmt)
+{
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        int i;
+        for (i = 0; i < sqlite3_column_count(stmt); i++)
+        {
+            (void) sqlite3_column_text(stmt, i);
+        }
+    }
+    check(rc, sqlite3_sql(stmt));
+    sqlite3_reset(stmt);
+}
+
+static void make_text(char* buf, int nwords)
+{
+    int i;
+    buf[0] = 0;
+    for (i = 0; i < nwords; i++)
+    {
+        if (i > 0)
+        {
+            strcat(buf, " ");
+        }
+        strcat(buf, words[rng() % NWORDS]);
+    }
+}
+
+static void oltp(int scale)
+{
+    sqlite3_stmt* ins_account;
+    sqlite3_stmt* ins_order;
+    sqlite3_stmt* sel_account;
+    sqlite3_stmt* sel_range;
+    sqlite3_stmt* sel_join;
+    sqlite3_stmt* upd_balance;
+    sqlite3_stmt* del_order;
+    int naccounts = 2000 * scale;
+    int i;
+
+    exec("CREATE TABLE accounts(id INTEGER PRIMARY KEY, name TEXT NOT NULL, balance INTEGER NOT NULL, updated TEXT);");
+    exec("CREATE INDEX accounts_name ON accounts(name);");
+    exec("CREATE TABLE orders(id INTEGER PRIMARY KEY, account INTEGER NOT NULL REFERENCES accounts(id), amount REAL, note TEXT);");
+    exec("CREATE INDEX orders_account ON orders(account);");
+
+    ins_account = prepare("INSERT INTO accounts(name, balance, updated) VALUES (?1, ?2, datetime('now'));");
+    ins_order = prepare("INSERT INTO orders(account, amount, note) VALUES (?1, ?2, ?3);");
+    sel_account = prepare("SELECT name, balance FROM accounts WHERE id = ?1;");
+    sel_range = prepare("SELECT id, balance FROM accounts WHERE name >= ?1 ORDER BY name LIMIT 20;");
+    sel_join = prepare("SELECT a.name, count(*), sum(o.amount) FROM accounts a JOIN orders o ON o.account = a.id WHERE a.id BETWEEN ?1 AND ?1 + 50 GROUP BY a.id;");
+    upd_balance = prepare("UPDATE accounts SET balance = balance + ?2, updated = datetime('now') WHERE id = ?1;");
+    del_order = prepare("DELETE FROM orders WHERE id = ?1;");
+
+    exec("BEGIN;");
+    for (i = 0; i < naccounts; i++)
+    {
+        char name[64];
+        make_text(name, 2);
+        sqlite3_bind_text(ins_account, 1, name, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(ins_account, 2, (int) (rng() % 100000));
+        run(ins_account);
+        if ((i % 100) == 99)
+        {
+            exec("COMMIT; BEGIN;");
+        }
+    }
+    exec("COMMIT;");
+
+    for (i = 0; i < 20 * naccounts; i++)
+    {
+        int id = 1 + (int) (rng() % naccounts);
+        switch (rng() % 10)
+        {
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+                sqlite3_bind_int(sel_account, 1, id);
+                run(sel_account);
+                break;
+            case 4:
+            {
+                char name[16];
+                make_text(name, 1);
+                sqlite3_bind_text(sel_range, 1, name, -1, SQLITE_TRANSIENT);
+                run(sel_range);
+                break;
+            }
+            case 5:
+                sqlite3_bind_int(sel_join, 1, id);
+                run(sel_join);
+                break;
+            case 6:
+            case 7:
+            {
+                char note[128];
+                make_text(note, 4);
+                sqlite3_bind_int(ins_order, 1, id);
+                sqlite3_bind_double(ins_order, 2, (rng() % 10000) / 100.0);
+                sqlite3_bind_text(ins_order, 3, note, -1, SQLITE_TRANSIENT);
+                run(ins_order);
+                break;
+            }
+            case 8:
+                sqlite3_bind_int(upd_balance, 1, id);
+                sqlite3_bind_int(upd_balance, 2, (int) (rng() % 200) - 100);
+                run(upd_balance);
+                break;
+            default:
+                sqlite3_bind_int(del_order, 1, 1 + (int) (rng() % (naccounts * 4)));
+                run(del_order);
+                break;
+        }
+    }
+
+    exec("SELECT count(*), avg(balance), max(updated) FROM accounts;");
+    exec("SELECT account, sum(amount) FROM orders GROUP BY account ORDER BY 2 DESC LIMIT 10;");
+
+    sqlite3_finalize(ins_account);
+    sqlite3_finalize(ins_order);
+    sqlite3_finalize(sel_account);
+    sqlite3_finalize(sel_range);
+    sqlite3_finalize(sel_join);
+    sqlite3_finalize(upd_balance);
+    sqlite3_finalize(del_order);
+}
+
+static void fts5(int scale)
+{
+    sqlite3_stmt* ins;
+    sqlite3_stmt* q;
+    int ndocs = 1000 * scale;
+    int i;
+
+    exec("CREATE VIRTUAL TABLE docs USING fts5(title, body);");
+    ins = prepare("INSERT INTO docs(title, body) VALUES (?1, ?2);");
+    exec("BEGIN;");
+    for (i = 0; i < ndocs; i++)
+    {
+        char title[64];
+        char body[1024];
+        make_text(title, 3);
+        make_text(body, 40 + (int) (rng() % 60));
+        sqlite3_bind_text(ins, 1, title, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(ins, 2, body, -1, SQLITE_TRANSIENT);
+        run(ins);
+    }
+    exec("COMMIT;");
+    sqlite3_finalize(ins);
+
+    q = prepare("SELECT rowid, highlight(docs, 0, '[', ']'), snippet(docs, 1, '<', '>', '...', 8) FROM docs WHERE docs MATCH ?1 ORDER BY bm25(docs) LIMIT 10;");
+    for (i = 0; i < 200 * scale; i++)
+    {
+        char expr[128];
+        const char* a = words[rng() % NWORDS];
+        const char* b = words[rng() % NWORDS];
+        switch (i % 5)
+        {
+            case 0:
+                sqlite3_snprintf(sizeof(expr), expr, "%s", a);
+                break;
+            case 1:
+                sqlite3_snprintf(sizeof(expr), expr, "%s AND %s", a, b);
+                break;
+            case 2:
+                sqlite3_snprintf(sizeof(expr), expr, "%s OR %s", a, b);
+                break;
+            case 3:
+                sqlite3_snprintf(sizeof(expr), expr, "NEAR(%s %s, 5)", a, b);
+                break;
+            default:
+                sqlite3_snprintf(sizeof(expr), expr, "title:%.2s*", a);
+                break;
+        }
+        sqlite3_bind_text(q, 1, expr, -1, SQLITE_TRANSIENT);
+        run(q);
+    }
+    sqlite3_finalize(q);
+    exec("INSERT INTO docs(docs) VALUES ('optimize');");
+}
+
+static void json1(int scale)
+{
+    sqlite3_stmt* ins;
+    sqlite3_stmt* q;
+    int nevents = 2000 * scale;
+    int i;
+
+    exec("CREATE TABLE events(id INTEGER PRIMARY KEY, payload TEXT);");
+    ins = prepare("INSERT INTO events(payload) VALUES (json_object('kind', ?1, 'score', ?2, 'tags', json_array(?3, ?4), 'user', json_object('id', ?5, 'name', ?6)));");
+    exec("BEGIN;");
+    for (i = 0; i < nevents; i++)
+    {
+        sqlite3_bind_text(ins, 1, words[rng() % 8], -1, SQLITE_STATIC);
+        sqlite3_bind_int(ins, 2, (int) (rng() % 1000));
+        sqlite3_bind_text(ins, 3, words[rng() % NWORDS], -1, SQLITE_STATIC);
+        sqlite3_bind_text(ins, 4, words[rng() % NWORDS], -1, SQLITE_STATIC);
+        sqlite3_bind_int(ins, 5, (int) (rng() % 500));
+        sqlite3_bind_text(ins, 6, words[rng() % NWORDS], -1, SQLITE_STATIC);
+        run(ins);
+    }
+    exec("COMMIT;");
+    sqlite3_finalize(ins);
+
+    q = prepare("SELECT json_extract(payload, '$.user.name'), payload ->> '$.score' FROM events WHERE json_extract(payload, '$.kind') = ?1 AND payload ->> '$.score' > ?2 LIMIT 50;");
+    for (i = 0; i < 50 * scale; i++)
+    {
+        sqlite3_bind_text(q, 1, words[rng() % 8], -1, SQLITE_STATIC);
+        sqlite3_bind_int(q, 2, (int) (rng() % 1000));
+        run(q);
+    }
+    sqlite3_finalize(q);
+
+    exec("SELECT j.value, count(*) FROM events, json_each(events.payload, '$.tags') AS j GROUP BY j.value;");
+    exec("SELECT json_group_array(json_object('id', id, 'score', payload ->> '$.score')) FROM events WHERE id % 97 = 0;");
+    exec("UPDATE events SET payload = json_set(payload, '$.score', (payload ->> '$.score') + 1) WHERE id % 13 = 0;");
+}
+
+static void rtree(int scale)
+{
+    sqlite3_stmt* ins;
+    sqlite3_stmt* q;
+    int nboxes = 5000 * scale;
+    int i;
+
+    exec("CREATE VIRTUAL TABLE boxes USING rtree(id, minx, maxx, miny, maxy);");
+    ins = prepare("INSERT INTO boxes VALUES (?1, ?2, ?3, ?4, ?5);");
+    exec("BEGIN;");
+    for (i = 0; i < nboxes; i++)
+    {
+        double x = (rng() % 100000) / 10.0;
+        double y = (rng() % 100000) / 10.0;
+        sqlite3_bind_int(ins, 1, i + 1);
+        sqlite3_bind_double(ins, 2, x);
+        sqlite3_bind_double(ins, 3, x + (rng() % 500) / 10.0);
+        sqlite3_bind_double(ins, 4, y);
+        sqlite3_bind_double(ins, 5, y + (rng() % 500) / 10.0);
+        run(ins);
+    }
+    exec("COMMIT;");
+    sqlite3_finalize(ins);
+
+    q = prepare("SELECT id FROM boxes WHERE minx <= ?2 AND maxx >= ?1 AND miny <= ?4 AND maxy >= ?3;");
+    for (i = 0; i < 500 * scale; i++)
+    {
+        double x = (rng() % 100000) / 10.0;
+        double y = (rng() % 100000) / 10.0;
+        double w = (rng() % 2000) / 10.0;
+        sqlite3_bind_double(q, 1, x);
+        sqlite3_bind_double(q, 2, x + w);
+        sqlite3_bind_double(q, 3, y);
+        sqlite3_bind_double(q, 4, y + w);
+        run(q);
+    }
+    sqlite3_finalize(q);
+}
+
+int main(int argc, char** argv)
+{
+    int scale = 1;
+    int rc;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s DBFILE [SCALE]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+    {
+        scale = atoi(argv[2]);
+        if (scale < 1)
+        {
+            scale = 1;
+        }
+    }
+    remove(argv[1]);
+
+    printf("%s\n", sqlite3_libversion());
+
+    rc = sqlite3_open(argv[1], &db);
+    check(rc, "open");
+    exec("PRAGMA journal_mode=WAL;");
+    exec("PRAGMA synchronous=NORMAL;");
+
+    oltp(scale);
+    fts5(scale);
+    json1(scale);
+    rtree(scale);
+
+    exec("ANALYZE;");
+    exec("PRAGMA integrity_check;");
+
+    rc = sqlite3_close(db);
+    check(rc, "close");
+
+    return 0;
+}
+
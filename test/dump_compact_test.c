@@ -0,0 +1,210 @@
+/*
+** Check that a ".dump --compact" of a database loads back into the same
+** content (sqlite3/shell.c), through ".read FILE" and through standard
+** input.
+**
+** It fills a database with tables that hold every storage class,
+** including integers at the varint boundaries, negative and special
+** reals, text with quotes, newlines and NUL bytes, empty and large
+** blobs, and NULLs, plus an index, a view and a trigger.  The shell then
+** writes a compact dump, loads it into two new databases, and reports
+** ".sha3sum --schema" for all three, in child processes.  The three
+** checksums must match.
+**
+** shell.c is included so that the shell can be run without a separate
+** binary.
+**
+** build: gcc -O2 -I../sqlite3 -o dump_compact_test dump_compact_test.c ../sqlite3/sqlite3.c -lpthread -ldl -lm
+**
+** usage: dump_compact_test [DIRECTORY]
+*/
+
+#define main dump_compact_test_shell_main
+#include "shell.c"
+#undef main
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static const char* zSchema =
+    "CREATE TABLE t1(a INTEGER PRIMARY KEY, b, c TEXT, d REAL, e BLOB);"
+    "CREATE TABLE t2(k TEXT PRIMARY KEY, v) WITHOUT ROWID;"
+    "CREATE TABLE \"odd \"\"name\"(x, y);"
+    "CREATE INDEX t1b ON t1(b);"
+    "CREATE VIEW v1 AS SELECT a, c FROM t1 WHERE a<10;"
+    "CREATE TRIGGER t1d AFTER DELETE ON t1 BEGIN DELETE FROM t2 WHERE k=old.c; END;"
+    "INSERT INTO t1 VALUES"
+    " (1, NULL, '', 0.0, x''),"
+    " (2, 127, 'it''s', -0.5, x'00'),"
+    " (3, 128, char(10,13,9), 1e308, zeroblob(70000)),"
+    " (4, -1, 'caf' || char(233), -1e-308, x'ff00ff'),"
+    " (5, 9223372036854775807, 'a' || char(0) || 'b', 3.141592653589793, NULL),"
+    " (6, -9223372036854775808, printf('%.*c', 100000, 'z'), 1.0, randomblob(300)),"
+    " (7, 16383, '\"quoted\"', 2.5e-10, x'0a0d'),"
+    " (8, 16384, '-- SQLite compact dump 1', -1.0, 'text in blob column');"
+    "WITH RECURSIVE c(n) AS (SELECT 9 UNION ALL SELECT n+1 FROM c WHERE n<9+5000)"
+    " INSERT INTO t1 SELECT n, n*n-50000000, hex(randomblob(n%40)), n/7.0,"
+    "  CASE WHEN n%3 THEN randomblob(n%50) END FROM c;"
+    "INSERT INTO t2 SELECT a || ':' || c, d FROM t1 WHERE a>8;"
+    "INSERT INTO \"odd \"\"name\" VALUES(1, 'one'), (NULL, x'01'), ('2', 2.0);";
+
+static void fail(const char* zMsg, const char* zArg)
+{
+    fprintf(stderr, "FAIL: %s %s\n", zMsg, zArg ? zArg : "");
+    exit(1);
+}
+
+/*
+** Run the shell on zDb with the given arguments, in a child process, with
+** standard input read from zIn if it is not NULL.  The parent never calls
+** into SQLite itself, so each child starts from a library that has not
+** been initialized.  The shell parses dot-commands in place, so the
+** arguments are copied to writable memory.
+*/
+static void run_shell(const char* zDb, const char* zIn, char** azCmd, int nCmd)
+{
+    char* azArg[8];
+    pid_t pid;
+    int status;
+    int i;
+
+    azArg[0] = "sqlite3";
+    azArg[1] = (char*)zDb;
+    for (i = 0; i < nCmd; i++)
+    {
+        azArg[i + 2] = strdup(azCmd[i]);
+        if (azArg[i + 2] == NULL)
+        {
+            fail("out of memory", 0);
+        }
+    }
+    azArg[nCmd + 2] = 0;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+        fail("fork failed", 0);
+    }
+    if (pid == 0)
+    {
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            _exit(2);
+        }
+        if (zIn != NULL && freopen(zIn, "rb", stdin) == NULL)
+        {
+            _exit(2);
+        }
+        exit(dump_compact_test_shell_main(nCmd + 2, azArg));
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fail("shell failed running", nCmd > 0 ? azCmd[nCmd - 1] : zIn);
+    }
+    for (i = 0; i < nCmd; i++)
+    {
+        free(azArg[i + 2]);
+    }
+}
+
+/* write ".sha3sum --schema" of zDb to zOutput */
+static void checksum_db(const char* zDb, const char* zOutput)
+{
+    char zCmd[FILENAME_MAX + 20];
+    char* azCmd[2];
+
+    snprintf(zCmd, sizeof(zCmd), ".output %s", zOutput);
+    azCmd[0] = zCmd;
+    azCmd[1] = ".sha3sum --schema";
+    run_shell(zDb, NULL, azCmd, 2);
+}
+
+static char* read_file(const char* zFile, long* pnByte)
+{
+    FILE* in = fopen(zFile, "rb");
+    char* z;
+    long n;
+
+    if (in == NULL)
+    {
+        fail("cannot read", zFile);
+    }
+    fseek(in, 0, SEEK_END);
+    n = ftell(in);
+    rewind(in);
+    z = malloc(n + 1);
+    if (z == NULL || (long)fread(z, 1, n, in) != n)
+    {
+        fail("cannot read", zFile);
+    }
+    fclose(in);
+    z[n] = 0;
+    *pnByte = n;
+    return z;
+}
+
+/* fail unless zFile holds the same checksum as zWant */
+static void check_same(const char* zFile, const char* zWant, long nWant)
+{
+    long n;
+    char* z = read_file(zFile, &n);
+    if (n != nWant || memcmp(z, zWant, n) != 0)
+    {
+        fail("content differs after loading the compact dump:", zFile);
+    }
+    free(z);
+}
+
+int main(int argc, char** argv)
+{
+    const char* zDir = argc > 1 ? argv[1] : ".";
+    char zDb[FILENAME_MAX], zRead[FILENAME_MAX], zStdin[FILENAME_MAX];
+    char zDump[FILENAME_MAX], zSum[FILENAME_MAX];
+    char zCmd[FILENAME_MAX + 20];
+    char* azCmd[2];
+    char* zWant;
+    long nWant;
+
+    snprintf(zDb, sizeof(zDb), "%s/dump_compact_test.db", zDir);
+    snprintf(zRead, sizeof(zRead), "%s/dump_compact_test_read.db", zDir);
+    snprintf(zStdin, sizeof(zStdin), "%s/dump_compact_test_stdin.db", zDir);
+    snprintf(zDump, sizeof(zDump), "%s/dump_compact_test.dump", zDir);
+    snprintf(zSum, sizeof(zSum), "%s/dump_compact_test.sum", zDir);
+    unlink(zDb);
+    unlink(zRead);
+    unlink(zStdin);
+
+    azCmd[0] = (char*)zSchema;
+    run_shell(zDb, NULL, azCmd, 1);
+
+    snprintf(zCmd, sizeof(zCmd), ".output %s", zDump);
+    azCmd[0] = zCmd;
+    azCmd[1] = ".dump --compact";
+    run_shell(zDb, NULL, azCmd, 2);
+
+    snprintf(zCmd, sizeof(zCmd), ".read %s", zDump);
+    azCmd[0] = zCmd;
+    run_shell(zRead, NULL, azCmd, 1);
+    run_shell(zStdin, zDump, NULL, 0);
+
+    checksum_db(zDb, zSum);
+    zWant = read_file(zSum, &nWant);
+    if (nWant == 0)
+    {
+        fail("no checksum for", zDb);
+    }
+    checksum_db(zRead, zSum);
+    check_same(zSum, zWant, nWant);
+    checksum_db(zStdin, zSum);
+    check_same(zSum, zWant, nWant);
+    printf("ok: compact dump loads back with checksum %s", zWant);
+
+    free(zWant);
+    unlink(zDb);
+    unlink(zRead);
+    unlink(zStdin);
+    unlink(zDump);
+    unlink(zSum);
+    return 0;
+}
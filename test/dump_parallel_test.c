@@ -0,0 +1,169 @@
+/*
+** Check that ".dump --parallel" writes exactly what a serial ".dump" does
+** (sqlite3/shell.c), including after earlier query output has left data
+** in the shell's row buffer.
+**
+** It fills a database with several tables, then runs the shell twice in
+** child processes: once with ".dump" and once with ".dump --parallel 4",
+** each after a query with a large result.  The two dumps must match byte
+** for byte.
+**
+** shell.c is included so that the shell can be run without a separate
+** binary.
+**
+** build: gcc -O2 -I../sqlite3 -o dump_parallel_test dump_parallel_test.c ../sqlite3/sqlite3.c -lpthread -ldl -lm
+**
+** usage: dump_parallel_test [DIRECTORY]
+*/
+
+#define main dump_parallel_test_shell_main
+#include "shell.c"
+#undef main
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define N_TABLE 8
+#define N_ROW 20000
+
+static void fail(const char* zMsg, const char* zArg)
+{
+    fprintf(stderr, "FAIL: %s %s\n", zMsg, zArg ? zArg : "");
+    exit(1);
+}
+
+/*
+** Run the shell on zDb with the given arguments, in a child process.  The
+** parent never calls into SQLite itself, so each child starts from a
+** library that has not been initialized.  The shell parses dot-commands
+** in place, so the arguments are copied to writable memory.
+*/
+static void run_shell(const char* zDb, char** azCmd, int nCmd)
+{
+    char* azArg[N_TABLE + 3];
+    pid_t pid;
+    int status;
+    int i;
+
+    azArg[0] = "sqlite3";
+    azArg[1] = (char*)zDb;
+    for (i = 0; i < nCmd; i++)
+    {
+        azArg[i + 2] = strdup(azCmd[i]);
+        if (azArg[i + 2] == NULL)
+        {
+            fail("out of memory", 0);
+        }
+    }
+    azArg[nCmd + 2] = 0;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+        fail("fork failed", 0);
+    }
+    if (pid == 0)
+    {
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            _exit(2);
+        }
+        exit(dump_parallel_test_shell_main(nCmd + 2, azArg));
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fail("shell failed running", azCmd[nCmd - 1]);
+    }
+    for (i = 0; i < nCmd; i++)
+    {
+        free(azArg[i + 2]);
+    }
+}
+
+static void make_db(const char* zDb)
+{
+    char aSql[N_TABLE][400];
+    char* azCmd[N_TABLE];
+    int i;
+
+    unlink(zDb);
+    for (i = 0; i < N_TABLE; i++)
+    {
+        snprintf(aSql[i], sizeof(aSql[i]),
+                 "CREATE TABLE t%d(x INTEGER PRIMARY KEY, y);"
+                 "WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n+1 FROM c WHERE n<%d)"
+                 " INSERT INTO t%d SELECT n, printf('t%d row %%d ''%%s''', n, hex(randomblob(8)))"
+                 " FROM c;",
+                 i, N_ROW, i, i);
+        azCmd[i] = aSql[i];
+    }
+    run_shell(zDb, azCmd, N_TABLE);
+}
+
+/* dump zDb to zOutput after a query with a large result */
+static void dump_db(const char* zDb, const char* zOutput, const char* zDump)
+{
+    char zCmd[FILENAME_MAX + 20];
+    char* azCmd[3];
+
+    snprintf(zCmd, sizeof(zCmd), ".output %s", zOutput);
+    azCmd[0] = "SELECT printf('%.*c', 100000, 'x');";
+    azCmd[1] = zCmd;
+    azCmd[2] = (char*)zDump;
+    run_shell(zDb, azCmd, 3);
+}
+
+static char* read_file(const char* zFile, long* pnByte)
+{
+    FILE* in = fopen(zFile, "rb");
+    char* z;
+    long n;
+
+    if (in == NULL)
+    {
+        fail("cannot read", zFile);
+    }
+    fseek(in, 0, SEEK_END);
+    n = ftell(in);
+    rewind(in);
+    z = malloc(n + 1);
+    if (z == NULL || (long)fread(z, 1, n, in) != n)
+    {
+        fail("cannot read", zFile);
+    }
+    fclose(in);
+    *pnByte = n;
+    return z;
+}
+
+int main(int argc, char** argv)
+{
+    const char* zDir = argc > 1 ? argv[1] : ".";
+    char zDb[FILENAME_MAX], zSerial[FILENAME_MAX], zParallel[FILENAME_MAX];
+    char *a, *b;
+    long na, nb;
+
+    snprintf(zDb, sizeof(zDb), "%s/dump_parallel_test.db", zDir);
+    snprintf(zSerial, sizeof(zSerial), "%s/dump_parallel_test_serial.sql", zDir);
+    snprintf(zParallel, sizeof(zParallel), "%s/dump_parallel_test_parallel.sql", zDir);
+
+    make_db(zDb);
+    dump_db(zDb, zSerial, ".dump");
+    dump_db(zDb, zParallel, ".dump --parallel 4");
+
+    a = read_file(zSerial, &na);
+    b = read_file(zParallel, &nb);
+    if (na == 0 || na != nb || memcmp(a, b, na) != 0)
+    {
+        fail("parallel dump differs from serial dump:", zParallel);
+    }
+    printf("ok: %ld byte dumps match\n", na);
+
+    free(a);
+    free(b);
+    unlink(zDb);
+    unlink(zSerial);
+    unlink(zParallel);
+    return 0;
+}
@@ -0,0 +1,460 @@
+
+/*
+** AES for e_sqlcipher, with hardware acceleration where the CPU has it.
+**
+** This file replaces libtomcrypt's ciphers/aes/aes.c in the e_sqlcipher
+** builds.  It compiles the portable implementation under another name and
+** defines aes_desc itself, so sqlcipher's find_cipher("aes") gets ECB and
+** CBC entry points that use AES-NI on x86/x64 or the ARMv8 Crypto
+** Extensions on arm64, and the portable table-driven code everywhere else.
+**
+** The key schedule still comes from rijndael_setup().  When the hardware
+** path is active, the round keys are converted in place from libtomcrypt's
+** big-endian words to the byte order the AES instructions expect.  The
+** choice is made once per process, so a key scheduled for one path is
+** never used by the other.
+**
+** GCM's PCLMUL and the SHA extensions are not used:  sqlcipher only runs
+** AES-256-CBC with HMAC-SHA512, and SHA-512 has no widely deployed
+** instructions on either architecture.
+*/
+
+#define aes_desc ltc_portable_aes_desc
+#include "ciphers/aes/aes.c"
+#undef aes_desc
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define AES_ACCEL_X86
+#elif defined(_M_ARM64) || (defined(__aarch64__) && (!defined(__clang__) || defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)))
+/* older clang only declares the AES intrinsics when compiling for +crypto */
+#define AES_ACCEL_ARM64
+#endif
+
+#if defined(AES_ACCEL_X86)
+#include <wmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(AES_ACCEL_ARM64)
+#if defined(_M_ARM64)
+#include <windows.h>
+#include <arm64_neon.h>
+#ifndef PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE
+#define PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE 30
+#endif
+#else
+#include <arm_neon.h>
+#endif
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#endif
+#endif
+
+#if defined(AES_ACCEL_X86) && defined(__GNUC__)
+#define AES_ACCEL_TARGET __attribute__((target("aes,sse2")))
+#elif defined(AES_ACCEL_ARM64) && defined(__GNUC__) && !defined(__clang__)
+#define AES_ACCEL_TARGET __attribute__((target("+crypto")))
+#else
+#define AES_ACCEL_TARGET
+#endif
+
+/* -1 until the first key setup, then 0 (portable) or 1 (hardware) */
+static volatile int aes_accel_state = -1;
+
+static int aes_accel_detect(void)
+{
+#if defined(AES_ACCEL_X86)
+#if defined(_MSC_VER)
+   int regs[4];
+   __cpuid(regs, 1);
+   return ((regs[2] & (1 << 25)) != 0) && ((regs[3] & (1 << 26)) != 0);
+#else
+   unsigned int a, b, c, d;
+   if (!__get_cpuid(1, &a, &b, &c, &d)) {
+      return 0;
+   }
+   return ((c & (1u << 25)) != 0) && ((d & (1u << 26)) != 0);
+#endif
+#elif defined(AES_ACCEL_ARM64)
+#if defined(_M_ARM64)
+   return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE) != 0;
+#elif defined(__APPLE__)
+   return 1;
+#elif defined(__linux__)
+   return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+   return 0;
+#endif
+#else
+   return 0;
+#endif
+}
+
+static int aes_accel_enabled(void)
+{
+   int state = aes_accel_state;
+   if (state < 0) {
+      state = aes_accel_detect();
+      aes_accel_state = state;
+   }
+   return state;
+}
+
+#if defined(AES_ACCEL_X86)
+
+AES_ACCEL_TARGET
+static void aes_accel_encrypt_block(const unsigned char *in, unsigned char *out, const unsigned char *rk, int Nr)
+{
+   __m128i b;
+   int r;
+   b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), _mm_loadu_si128((const __m128i *)rk));
+   for (r = 1; r < Nr; r++) {
+      b = _mm_aesenc_si128(b, _mm_loadu_si128((const __m128i *)(rk + 16 * r)));
+   }
+   b = _mm_aesenclast_si128(b, _mm_loadu_si128((const __m128i *)(rk + 16 * Nr)));
+   _mm_storeu_si128((__m128i *)out, b);
+}
+
+AES_ACCEL_TARGET
+static void aes_accel_decrypt_block(const unsigned char *in, unsigned char *out, const unsigned char *rk, int Nr)
+{
+   __m128i b;
+   int r;
+   b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), _mm_loadu_si128((const __m128i *)rk));
+   for (r = 1; r < Nr; r++) {
+      b = _mm_aesdec_si128(b, _mm_loadu_si128((const __m128i *)(rk + 16 * r)));
+   }
+   b = _mm_aesdeclast_si128(b, _mm_loadu_si128((const __m128i *)(rk + 16 * Nr)));
+   _mm_storeu_si128((__m128i *)out, b);
+}
+
+AES_ACCEL_TARGET
+static void aes_accel_cbc_encrypt_blocks(const unsigned char *pt, unsigned char *ct, unsigned long blocks, unsigned char *IV, const unsigned char *rk, int Nr)
+{
+   __m128i k[15];
+   __m128i b;
+   int r;
+   for (r = 0; r <= Nr; r++) {
+      k[r] = _mm_loadu_si128((const __m128i *)(rk + 16 * r));
+   }
+   b = _mm_loadu_si128((const __m128i *)IV);
+   while (blocks-- > 0) {
+      b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)pt));
+      b = _mm_xor_si128(b, k[0]);
+      for (r = 1; r < Nr; r++) {
+         b = _mm_aesenc_si128(b, k[r]);
+      }
+      b = _mm_aesenclast_si128(b, k[Nr]);
+      _mm_storeu_si128((__m128i *)ct, b);
+      pt += 16;
+      ct += 16;
+   }
+   _mm_storeu_si128((__m128i *)IV, b);
+}
+
+/* CBC decryption has no dependency between blocks, so four are kept in flight */
+AES_ACCEL_TARGET
+static void aes_accel_cbc_decrypt_blocks(const unsigned char *ct, unsigned char *pt, unsigned long blocks, unsigned char *IV, const unsigned char *rk, int Nr)
+{
+   __m128i k[15];
+   __m128i prev, c0, c1, c2, c3, b0, b1, b2, b3;
+   int r;
+   for (r = 0; r <= Nr; r++) {
+      k[r] = _mm_loadu_si128((const __m128i *)(rk + 16 * r));
+   }
+   prev = _mm_loadu_si128((const __m128i *)IV);
+   while (blocks >= 4) {
+      c0 = _mm_loadu_si128((const __m128i *)(ct + 0));
+      c1 = _mm_loadu_si128((const __m128i *)(ct + 16));
+      c2 = _mm_loadu_si128((const __m128i *)(ct + 32));
+      c3 = _mm_loadu_si128((const __m128i *)(ct + 48));
+      b0 = _mm_xor_si128(c0, k[0]);
+      b1 = _mm_xor_si128(c1, k[0]);
+      b2 = _mm_xor_si128(c2, k[0]);
+      b3 = _mm_xor_si128(c3, k[0]);
+      for (r = 1; r < Nr; r++) {
+         b0 = _mm_aesdec_si128(b0, k[r]);
+         b1 = _mm_aesdec_si128(b1, k[r]);
+         b2 = _mm_aesdec_si128(b2, k[r]);
+         b3 = _mm_aesdec_si128(b3, k[r]);
+      }
+      b0 = _mm_aesdeclast_si128(b0, k[Nr]);
+      b1 = _mm_aesdeclast_si128(b1, k[Nr]);
+      b2 = _mm_aesdeclast_si128(b2, k[Nr]);
+      b3 = _mm_aesdeclast_si128(b3, k[Nr]);
+      _mm_storeu_si128((__m128i *)(pt + 0), _mm_xor_si128(b0, prev));
+      _mm_storeu_si128((__m128i *)(pt + 16), _mm_xor_si128(b1, c0));
+      _mm_storeu_si128((__m128i *)(pt + 32), _mm_xor_si128(b2, c1));
+      _mm_storeu_si128((__m128i *)(pt + 48), _mm_xor_si128(b3, c2));
+      prev = c3;
+      ct += 64;
+      pt += 64;
+      blocks -= 4;
+   }
+   while (blocks-- > 0) {
+      c0 = _mm_loadu_si128((const __m128i *)ct);
+      b0 = _mm_xor_si128(c0, k[0]);
+      for (r = 1; r < Nr; r++) {
+         b0 = _mm_aesdec_si128(b0, k[r]);
+      }
+      b0 = _mm_aesdeclast_si128(b0, k[Nr]);
+      _mm_storeu_si128((__m128i *)pt, _mm_xor_si128(b0, prev));
+      prev = c0;
+      ct += 16;
+      pt += 16;
+   }
+   _mm_storeu_si128((__m128i *)IV, prev);
+}
+
+#elif defined(AES_ACCEL_ARM64)
+
+/*
+** AESE/AESD fold the AddRoundKey step in before SubBytes/ShiftRows, so the
+** round loops below are shifted by one key compared to the x86 versions.
+*/
+
+AES_ACCEL_TARGET
+static uint8x16_t aes_accel_encrypt_neon(uint8x16_t b, const uint8x16_t *k, int Nr)
+{
+   int r;
+   for (r = 0; r < Nr - 1; r++) {
+      b = vaesmcq_u8(vaeseq_u8(b, k[r]));
+   }
+   b = vaeseq_u8(b, k[Nr - 1]);
+   return veorq_u8(b, k[Nr]);
+}
+
+AES_ACCEL_TARGET
+static uint8x16_t aes_accel_decrypt_neon(uint8x16_t b, const uint8x16_t *k, int Nr)
+{
+   int r;
+   for (r = 0; r < Nr - 1; r++) {
+      b = vaesimcq_u8(vaesdq_u8(b, k[r]));
+   }
+   b = vaesdq_u8(b, k[Nr - 1]);
+   return veorq_u8(b, k[Nr]);
+}
+
+AES_ACCEL_TARGET
+static void aes_accel_encrypt_block(const unsigned char *in, unsigned char *out, const unsigned char *rk, int Nr)
+{
+   uint8x16_t k[15];
+   int r;
+   for (r = 0; r <= Nr; r++) {
+      k[r] = vld1q_u8(rk + 16 * r);
+   }
+   vst1q_u8(out, aes_accel_encrypt_neon(vld1q_u8(in), k, Nr));
+}
+
+AES_ACCEL_TARGET
+static void aes_accel_decrypt_block(const unsigned char *in, unsigned char *out, const unsigned char *rk, int Nr)
+{
+   uint8x16_t k[15];
+   int r;
+   for (r = 0; r <= Nr; r++) {
+      k[r] = vld1q_u8(rk + 16 * r);
+   }
+   vst1q_u8(out, aes_accel_decrypt_neon(vld1q_u8(in), k, Nr));
+}
+
+AES_ACCEL_TARGET
+static void aes_accel_cbc_encrypt_blocks(const unsigned char *pt, unsigned char *ct, unsigned long blocks, unsigned char *IV, const unsigned char *rk, int Nr)
+{
+   uint8x16_t k[15];
+   uint8x16_t b;
+   int r;
+   for (r = 0; r <= Nr; r++) {
+      k[r] = vld1q_u8(rk + 16 * r);
+   }
+   b = vld1q_u8(IV);
+   while (blocks-- > 0) {
+      b = aes_accel_encrypt_neon(veorq_u8(b, vld1q_u8(pt)), k, Nr);
+      vst1q_u8(ct, b);
+      pt += 16;
+      ct += 16;
+   }
+   vst1q_u8(IV, b);
+}
+
+AES_ACCEL_TARGET
+static void aes_accel_cbc_decrypt_blocks(const unsigned char *ct, unsigned char *pt, unsigned long blocks, unsigned char *IV, const unsigned char *rk, int Nr)
+{
+   uint8x16_t k[15];
+   uint8x16_t prev, c0, c1, c2, c3, b0, b1, b2, b3;
+   int r;
+   for (r = 0; r <= Nr; r++) {
+      k[r] = vld1q_u8(rk + 16 * r);
+   }
+   prev = vld1q_u8(IV);
+   while (blocks >= 4) {
+      c0 = vld1q_u8(ct + 0);
+      c1 = vld1q_u8(ct + 16);
+      c2 = vld1q_u8(ct + 32);
+      c3 = vld1q_u8(ct + 48);
+      b0 = c0;
+      b1 = c1;
+      b2 = c2;
+      b3 = c3;
+      for (r = 0; r < Nr - 1; r++) {
+         b0 = vaesimcq_u8(vaesdq_u8(b0, k[r]));
+         b1 = vaesimcq_u8(vaesdq_u8(b1, k[r]));
+         b2 = vaesimcq_u8(vaesdq_u8(b2, k[r]));
+         b3 = vaesimcq_u8(vaesdq_u8(b3, k[r]));
+      }
+      b0 = veorq_u8(vaesdq_u8(b0, k[Nr - 1]), k[Nr]);
+      b1 = veorq_u8(vaesdq_u8(b1, k[Nr - 1]), k[Nr]);
+      b2 = veorq_u8(vaesdq_u8(b2, k[Nr - 1]), k[Nr]);
+      b3 = veorq_u8(vaesdq_u8(b3, k[Nr - 1]), k[Nr]);
+      vst1q_u8(pt + 0, veorq_u8(b0, prev));
+      vst1q_u8(pt + 16, veorq_u8(b1, c0));
+      vst1q_u8(pt + 32, veorq_u8(b2, c1));
+      vst1q_u8(pt + 48, veorq_u8(b3, c2));
+      prev = c3;
+      ct += 64;
+      pt += 64;
+      blocks -= 4;
+   }
+   while (blocks-- > 0) {
+      c0 = vld1q_u8(ct);
+      vst1q_u8(pt, veorq_u8(aes_accel_decrypt_neon(c0, k, Nr), prev));
+      prev = c0;
+      ct += 16;
+      pt += 16;
+   }
+   vst1q_u8(IV, prev);
+}
+
+#endif
+
+#if defined(AES_ACCEL_X86) || defined(AES_ACCEL_ARM64)
+#define AES_ACCEL_RK(skey)  ((const unsigned char *)(skey)->rijndael.eK)
+#define AES_ACCEL_DRK(skey) ((const unsigned char *)(skey)->rijndael.dK)
+#endif
+
+static int aes_accel_setup(const unsigned char *key, int keylen, int num_rounds, symmetric_key *skey)
+{
+   int err;
+
+   if ((err = rijndael_setup(key, keylen, num_rounds, skey)) != CRYPT_OK) {
+      return err;
+   }
+#if defined(AES_ACCEL_X86) || defined(AES_ACCEL_ARM64)
+   if (aes_accel_enabled()) {
+      /* rewrite both schedules from big-endian words to byte order */
+      int i;
+      int n = 4 * (skey->rijndael.Nr + 1);
+      ulong32 w;
+      for (i = 0; i < n; i++) {
+         w = skey->rijndael.eK[i];
+         STORE32H(w, (unsigned char *)&skey->rijndael.eK[i]);
+         w = skey->rijndael.dK[i];
+         STORE32H(w, (unsigned char *)&skey->rijndael.dK[i]);
+      }
+   }
+#endif
+   return CRYPT_OK;
+}
+
+static int aes_accel_ecb_encrypt(const unsigned char *pt, unsigned char *ct, symmetric_key *skey)
+{
+#if defined(AES_ACCEL_X86) || defined(AES_ACCEL_ARM64)
+   if (aes_accel_enabled()) {
+      LTC_ARGCHK(pt != NULL);
+      LTC_ARGCHK(ct != NULL);
+      LTC_ARGCHK(skey != NULL);
+      aes_accel_encrypt_block(pt, ct, AES_ACCEL_RK(skey), skey->rijndael.Nr);
+      return CRYPT_OK;
+   }
+#endif
+   return rijndael_ecb_encrypt(pt, ct, skey);
+}
+
+static int aes_accel_ecb_decrypt(const unsigned char *ct, unsigned char *pt, symmetric_key *skey)
+{
+#if defined(AES_ACCEL_X86) || defined(AES_ACCEL_ARM64)
+   if (aes_accel_enabled()) {
+      LTC_ARGCHK(pt != NULL);
+      LTC_ARGCHK(ct != NULL);
+      LTC_ARGCHK(skey != NULL);
+      aes_accel_decrypt_block(ct, pt, AES_ACCEL_DRK(skey), skey->rijndael.Nr);
+      return CRYPT_OK;
+   }
+#endif
+   return rijndael_ecb_decrypt(ct, pt, skey);
+}
+
+static int aes_accel_cbc_encrypt(const unsigned char *pt, unsigned char *ct, unsigned long blocks, unsigned char *IV, symmetric_key *skey)
+{
+   unsigned char buf[16];
+   int x, err;
+
+   LTC_ARGCHK(pt != NULL);
+   LTC_ARGCHK(ct != NULL);
+   LTC_ARGCHK(IV != NULL);
+   LTC_ARGCHK(skey != NULL);
+
+#if defined(AES_ACCEL_X86) || defined(AES_ACCEL_ARM64)
+   if (aes_accel_enabled()) {
+      aes_accel_cbc_encrypt_blocks(pt, ct, blocks, IV, AES_ACCEL_RK(skey), skey->rijndael.Nr);
+      return CRYPT_OK;
+   }
+#endif
+   while (blocks-- > 0) {
+      for (x = 0; x < 16; x++) {
+         buf[x] = IV[x] ^ pt[x];
+      }
+      if ((err = rijndael_ecb_encrypt(buf, ct, skey)) != CRYPT_OK) {
+         return err;
+      }
+      XMEMCPY(IV, ct, 16);
+      pt += 16;
+      ct += 16;
+   }
+   return CRYPT_OK;
+}
+
+static int aes_accel_cbc_decrypt(const unsigned char *ct, unsigned char *pt, unsigned long blocks, unsigned char *IV, symmetric_key *skey)
+{
+   unsigned char buf[16], saved[16];
+   int x, err;
+
+   LTC_ARGCHK(pt != NULL);
+   LTC_ARGCHK(ct != NULL);
+   LTC_ARGCHK(IV != NULL);
+   LTC_ARGCHK(skey != NULL);
+
+#if defined(AES_ACCEL_X86) || defined(AES_ACCEL_ARM64)
+   if (aes_accel_enabled()) {
+      aes_accel_cbc_decrypt_blocks(ct, pt, blocks, IV, AES_ACCEL_DRK(skey), skey->rijndael.Nr);
+      return CRYPT_OK;
+   }
+#endif
+   while (blocks-- > 0) {
+      XMEMCPY(saved, ct, 16);
+      if ((err = rijndael_ecb_decrypt(ct, buf, skey)) != CRYPT_OK) {
+         return err;
+      }
+      for (x = 0; x < 16; x++) {
+         pt[x] = buf[x] ^ IV[x];
+      }
+      XMEMCPY(IV, saved, 16);
+      pt += 16;
+      ct += 16;
+   }
+   return CRYPT_OK;
+}
+
+const struct ltc_cipher_descriptor aes_desc =
+{
+    "aes",
+    6,
+    16, 32, 16, 10,
+    aes_accel_setup, aes_accel_ecb_encrypt, aes_accel_ecb_decrypt, rijndael_test, rijndael_done, rijndael_keysize,
+    NULL, NULL, aes_accel_cbc_encrypt, aes_accel_cbc_decrypt, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
@@ -0,0 +1,265 @@
+/*
+** Process-wide cache of PBKDF2 results for e_sqlcipher.
+**
+** sqlcipher derives the page key with pkcs_5_alg2() at a high iteration
+** count every time a connection is keyed, so a pool that opens many
+** connections to one encrypted file pays the full KDF cost on each open.
+** This file replaces libtomcrypt's misc/pkcs5/pkcs_5_2.c in the
+** e_sqlcipher builds.  It compiles the original under another name and
+** defines pkcs_5_alg2() itself, returning a previously derived key when
+** the salt, passphrase, hash and iteration count all match.
+**
+** The cache is off until the application calls
+**
+**     int e_sqlcipher_kdf_cache(int nEntry);
+**
+** with nEntry > 0, at most KDF_CACHE_MAX_ENTRIES.  Calling it with 0
+** disables the cache.  Any call zeroizes and releases the current entries.
+**
+** Entries are looked up by a SHA-256 digest over the KDF parameters, the
+** salt and the passphrase, so the passphrase itself is never retained.
+** The derived keys live in a fixed-size arena that is locked into RAM
+** (mlock / VirtualLock) and excluded from core dumps where the platform
+** allows it.  When the arena is full the least recently used entry is
+** overwritten, and every entry is zeroized before its slot is reused or
+** the arena is freed.
+**
+** On 64-bit platforms an entry takes 112 bytes, so the largest cache
+** needs 112 KiB of locked memory, more than the common 64 KiB
+** RLIMIT_MEMLOCK default.  If the arena cannot be locked at the requested
+** size, the entry count is halved until it can; with a 64 KiB limit that
+** is at most 512 entries.  SQLITE_NOMEM is returned only if not even one
+** entry can be locked.
+**
+** Only derivations of at least KDF_CACHE_MIN_ITER iterations are cached.
+** sqlcipher also runs a 2-iteration PBKDF2 for the HMAC key, and that
+** is cheap enough that it shouldn't take up a slot.
+*/
+
+#define pkcs_5_alg2 ltc_pkcs_5_alg2_uncached
+#include "misc/pkcs5/pkcs_5_2.c"
+#undef pkcs_5_alg2
+
+#include "sqlite3.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define KDF_CACHE_MMAN
+#endif
+
+#define KDF_CACHE_MIN_ITER 1000
+#define KDF_CACHE_MAX_KEY 64
+#define KDF_CACHE_MAX_ENTRIES 1024
+
+struct kdf_cache_entry {
+   unsigned char id[32];
+   unsigned char key[KDF_CACHE_MAX_KEY];
+   unsigned long keylen;
+   sqlite3_uint64 last_used;   /* 0 means the slot is empty */
+};
+
+static struct kdf_cache_entry *kdf_cache_arena;
+static size_t kdf_cache_arena_size;
+static int kdf_cache_count;
+static sqlite3_uint64 kdf_cache_clock;
+
+static sqlite3_mutex *kdf_cache_mutex(void)
+{
+   return sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP3);
+}
+
+static struct kdf_cache_entry *kdf_cache_arena_alloc(size_t size)
+{
+   void *p;
+#if defined(_WIN32)
+   p = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+   if (p == NULL) {
+      return NULL;
+   }
+   if (!VirtualLock(p, size)) {
+      VirtualFree(p, 0, MEM_RELEASE);
+      return NULL;
+   }
+#elif defined(KDF_CACHE_MMAN)
+   p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+   if (p == MAP_FAILED) {
+      return NULL;
+   }
+   if (mlock(p, size) != 0) {
+      munmap(p, size);
+      return NULL;
+   }
+#if defined(MADV_DONTDUMP)
+   madvise(p, size, MADV_DONTDUMP);
+#endif
+#else
+   /* no page locking available (e.g. wasm) */
+   p = sqlite3_malloc64(size);
+   if (p == NULL) {
+      return NULL;
+   }
+#endif
+   memset(p, 0, size);
+   return (struct kdf_cache_entry *)p;
+}
+
+static void kdf_cache_arena_free(struct kdf_cache_entry *p, size_t size)
+{
+   zeromem(p, size);
+#if defined(_WIN32)
+   VirtualUnlock(p, size);
+   VirtualFree(p, 0, MEM_RELEASE);
+#elif defined(KDF_CACHE_MMAN)
+   munlock(p, size);
+   munmap(p, size);
+#else
+   sqlite3_free(p);
+#endif
+}
+
+SQLITE_API int e_sqlcipher_kdf_cache(int nEntry)
+{
+   sqlite3_mutex *mutex;
+   struct kdf_cache_entry *arena = NULL;
+   size_t size = 0;
+   int rc = SQLITE_OK;
+
+   if (nEntry < 0 || nEntry > KDF_CACHE_MAX_ENTRIES) {
+      return SQLITE_MISUSE;
+   }
+   if ((rc = sqlite3_initialize()) != SQLITE_OK) {
+      return rc;
+   }
+   /* shrink the arena until it fits within the locked memory limit */
+   while (nEntry > 0) {
+      size = (size_t)nEntry * sizeof(struct kdf_cache_entry);
+      arena = kdf_cache_arena_alloc(size);
+      if (arena != NULL) {
+         break;
+      }
+      nEntry /= 2;
+      size = 0;
+      if (nEntry == 0) {
+         rc = SQLITE_NOMEM;
+      }
+   }
+
+   mutex = kdf_cache_mutex();
+   sqlite3_mutex_enter(mutex);
+   if (kdf_cache_arena != NULL) {
+      kdf_cache_arena_free(kdf_cache_arena, kdf_cache_arena_size);
+   }
+   kdf_cache_arena = arena;
+   kdf_cache_arena_size = size;
+   kdf_cache_count = nEntry;
+   kdf_cache_clock = 0;
+   sqlite3_mutex_leave(mutex);
+
+   return rc;
+}
+
+static void kdf_cache_process_u32(hash_state *md, unsigned long v)
+{
+   unsigned char buf[4];
+   STORE32H(v, buf);
+   sha256_process(md, buf, 4);
+}
+
+static void kdf_cache_id(const unsigned char *password, unsigned long password_len,
+                         const unsigned char *salt, unsigned long salt_len,
+                         int iteration_count, int hash_idx, unsigned long outlen,
+                         unsigned char *id)
+{
+   hash_state md;
+
+   sha256_init(&md);
+   sha256_process(&md, (const unsigned char *)hash_descriptor[hash_idx].name,
+                  (unsigned long)strlen(hash_descriptor[hash_idx].name) + 1);
+   kdf_cache_process_u32(&md, (unsigned long)iteration_count);
+   kdf_cache_process_u32(&md, outlen);
+   kdf_cache_process_u32(&md, salt_len);
+   sha256_process(&md, salt, salt_len);
+   kdf_cache_process_u32(&md, password_len);
+   sha256_process(&md, password, password_len);
+   sha256_done(&md, id);
+   zeromem(&md, sizeof(md));
+}
+
+int pkcs_5_alg2(const unsigned char *password, unsigned long password_len,
+                const unsigned char *salt,     unsigned long salt_len,
+                int iteration_count,           int hash_idx,
+                unsigned char *out,            unsigned long *outlen)
+{
+   sqlite3_mutex *mutex;
+   struct kdf_cache_entry *e, *victim;
+   unsigned char id[32];
+   int i, err, enabled, hit = 0;
+
+   mutex = kdf_cache_mutex();
+   sqlite3_mutex_enter(mutex);
+   enabled = kdf_cache_count > 0;
+   sqlite3_mutex_leave(mutex);
+
+   if (!enabled || iteration_count < KDF_CACHE_MIN_ITER
+       || outlen == NULL || *outlen == 0 || *outlen > KDF_CACHE_MAX_KEY
+       || hash_is_valid(hash_idx) != CRYPT_OK) {
+      return ltc_pkcs_5_alg2_uncached(password, password_len, salt, salt_len,
+                                      iteration_count, hash_idx, out, outlen);
+   }
+   LTC_ARGCHK(password != NULL);
+   LTC_ARGCHK(salt     != NULL);
+   LTC_ARGCHK(out      != NULL);
+
+   kdf_cache_id(password, password_len, salt, salt_len, iteration_count, hash_idx, *outlen, id);
+
+   sqlite3_mutex_enter(mutex);
+   for (i = 0; i < kdf_cache_count; i++) {
+      e = &kdf_cache_arena[i];
+      if (e->last_used != 0 && XMEMCMP(e->id, id, sizeof(id)) == 0) {
+         XMEMCPY(out, e->key, e->keylen);
+         *outlen = e->keylen;
+         e->last_used = ++kdf_cache_clock;
+         hit = 1;
+         break;
+      }
+   }
+   sqlite3_mutex_leave(mutex);
+   if (hit) {
+      zeromem(id, sizeof(id));
+      return CRYPT_OK;
+   }
+
+   /* derive outside the lock so unrelated opens don't wait on each other */
+   if ((err = ltc_pkcs_5_alg2_uncached(password, password_len, salt, salt_len,
+                                       iteration_count, hash_idx, out, outlen)) != CRYPT_OK) {
+      zeromem(id, sizeof(id));
+      return err;
+   }
+
+   sqlite3_mutex_enter(mutex);
+   /* the cache may have been resized or disabled while we were deriving */
+   victim = NULL;
+   for (i = 0; i < kdf_cache_count; i++) {
+      e = &kdf_cache_arena[i];
+      if (e->last_used != 0 && XMEMCMP(e->id, id, sizeof(id)) == 0) {
+         victim = e;
+         break;
+      }
+      if (victim == NULL || e->last_used < victim->last_used) {
+         victim = e;
+      }
+   }
+   if (victim != NULL) {
+      zeromem(victim, sizeof(*victim));
+      XMEMCPY(victim->id, id, sizeof(id));
+      XMEMCPY(victim->key, out, *outlen);
+      victim->keylen = *outlen;
+      victim->last_used = ++kdf_cache_clock;
+   }
+   sqlite3_mutex_leave(mutex);
+
+   zeromem(id, sizeof(id));
+   return CRYPT_OK;
+}